@@ -12,8 +12,33 @@
 #include <linux/slab.h>
 #include <linux/kernel.h>
 #include <linux/hw_random.h>
-#include <linux/random.h>
-#include <linux/kthread.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/percpu.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/scatterlist.h>
+#include <linux/sched/signal.h>
+#include <linux/pm_runtime.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <crypto/rng.h>
+
+#include "pico_rng_uapi.h"
+
+#define CREATE_TRACE_POINTS
+#include "pico_rng_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Mickey Malone");
@@ -26,6 +51,56 @@ MODULE_VERSION("1.0");
 #define VENDOR_ID             0x0
 #define PRODUCT_ID            0x4
 
+/**
+ * URB pipeline Macros
+ * Every data path keeps PICO_RNG_NUM_URBS bulk URBs of PICO_RNG_URB_PACKETS packets each in flight,
+ * their completions fill a buffer_size byte fifo the readers drain.
+ **/
+#define PICO_RNG_NUM_URBS     8
+#define PICO_RNG_URB_PACKETS  8
+
+/**
+ * Per-CPU cache Macros
+ * Reads smaller than PICO_RNG_PERCPU_SIZE are served from a cache on the reader's CPU,
+ * refilled with PICO_RNG_PERCPU_SIZE bytes from the fifo at a time.
+ **/
+#define PICO_RNG_PERCPU_SIZE  4096
+
+/**
+ * splice(2) and sendfile(2) out of the character devices go through read_iter into the pipe's pages
+ **/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define pico_rng_splice_read copy_splice_read
+#else
+#define pico_rng_splice_read generic_file_splice_read
+#endif
+
+/**
+ * Buckets of the latency histograms in debugfs, bucket n counts latencies of [2^(n-1), 2^n) usecs
+ **/
+#define PICO_RNG_HIST_BUCKETS 24
+
+/**
+ * Bytes of the hwrng path's stream held back for the kernel pool, out of reach of the character devices
+ **/
+#define PICO_RNG_POOL_SIZE    4096
+
+/**
+ * DRBG Macros
+ * A file in PICO_RNG_READ_DRBG mode seeds its DRBG with PICO_RNG_DRBG_SEED_SIZE bytes from the Pico
+ * and generates PICO_RNG_DRBG_CHUNK bytes at a time.
+ **/
+#define PICO_RNG_DRBG_SEED_SIZE  48
+#define PICO_RNG_DRBG_CHUNK      4096
+
+/**
+ * Health test Macros
+ * SP 800-90B continuous tests over the bytes fed to hwrng. The APT uses the 512 sample window for non-binary
+ * sources, and after a failure nothing is fed until PICO_RNG_HEALTH_RECOVER bytes in a row passed again.
+ **/
+#define PICO_RNG_HEALTH_APT_WINDOW  512
+#define PICO_RNG_HEALTH_RECOVER     4096
+
 /**
  * Logger Macros
  **/
@@ -49,39 +124,335 @@ module_param(timeout, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 MODULE_PARM_DESC(timeout, "Set the read timeout in milliseconds for the pico rng usb device. Defaults to 100.");
 
 /**
- * The main data structure for this module.
+ * Data paths of the device, one bulk in endpoint each. EP1 is path 0, EP2 is path 1 and so on.
+ **/
+enum pico_rng_path_id {
+	PICO_RNG_PATH_SELECTED = 0,   // EP1, the stream selected on the device (raw unless told otherwise)
+	PICO_RNG_PATH_RAW,            // EP2, unconditioned samples for health monitoring
+	PICO_RNG_PATH_CONDITIONED,    // EP3, conditioned output for consumers
+	PICO_RNG_NUM_PATHS
+};
+
+/**
+ * Lever that will pick the data path served by the character device. Defaults to 0 (EP1).
+ **/
+static int path = PICO_RNG_PATH_SELECTED;
+module_param(path, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(path, "Data path served by /dev/pico_rng and /dev/pico_rng<n>. 0 = selected stream (EP1), 1 = raw (EP2), 2 = conditioned (EP3). Defaults to 0.");
+
+/**
+ * Lever that will create /dev/pico_rng, spreading its reads over every Pico plugged in. Defaults to 1 or true.
+ **/
+static bool aggregate = true;
+module_param(aggregate, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(aggregate, "Create /dev/pico_rng reading round robin from all devices. Defaults to 1.");
+
+/**
+ * Lever that will set the size in bytes of the buffer each data path prefetches into. Rounded up to a power of 2. Defaults to 16384.
+ **/
+static int buffer_size = 16384;
+module_param(buffer_size, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(buffer_size, "Set the size in bytes of the prefetch buffer of each data path. Defaults to 16384.");
+
+/**
+ * Lever that will cap the number of bytes a single read of /dev/pico_rng returns. Defaults to 1 MiB.
+ **/
+static int max_read = 1048576;
+module_param(max_read, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(max_read, "Set the most bytes a single read of /dev/pico_rng returns. Defaults to 1048576.");
+
+/**
+ * Lever that will serve reads smaller than PICO_RNG_PERCPU_SIZE from the per-CPU caches. Defaults to 0 or false.
+ * Off, every read takes the fifo's read_lock, which is what the caches are measured against. It stays off
+ * until a reader scaling run shows the caches paying for themselves.
+ **/
+static bool percpu_cache = false;
+module_param(percpu_cache, bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(percpu_cache, "Serve small reads from per-CPU caches. Defaults to 0.");
+
+/**
+ * Lever that will set the size in bytes of the ring shared with a process that mmaps /dev/pico_rng<n>.
+ * Rounded down to a power of 2, at least a page. Defaults to 1 MiB.
+ **/
+static int mmap_size = 1048576;
+module_param(mmap_size, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(mmap_size, "Set the size in bytes of the ring shared through mmap. Defaults to 1048576.");
+
+/**
+ * Levers that will set the kernel crypto API DRBG of files in PICO_RNG_READ_DRBG mode and how often it is reseeded from the Pico.
+ * It is reseeded once it generated drbg_reseed_bytes or drbg_reseed_ms went by, whichever comes first.
+ **/
+static char *drbg_name = "drbg_nopr_hmac_sha256";
+module_param(drbg_name, charp, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(drbg_name, "Set the crypto API rng used in DRBG read mode. Defaults to drbg_nopr_hmac_sha256.");
+
+static int drbg_reseed_bytes = 1048576;
+module_param(drbg_reseed_bytes, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(drbg_reseed_bytes, "Set the bytes generated in DRBG read mode between reseeds from the Pico. Defaults to 1048576.");
+
+static int drbg_reseed_ms = 60000;
+module_param(drbg_reseed_ms, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(drbg_reseed_ms, "Set the milliseconds between reseeds from the Pico in DRBG read mode. Defaults to 60000.");
+
+/**
+ * Lever that will set the entropy credited per raw extracted byte fed to the kernel through hwrng, 0-8 bits. Defaults to 1.
+ * It is also the min-entropy per byte the health tests assume, so higher credit means tighter cutoffs.
+ * The hwrng core reads 0 as full credit, so 0 is handed to it as the lowest credit it takes instead.
+ **/
+static ushort credit_bits = 1;
+module_param(credit_bits, ushort, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(credit_bits, "Set the entropy bits credited per raw byte read through hwrng while the health tests pass (0-8). Defaults to 1.");
+
+/**
+ * Lever that will turn on autosuspend, suspending an idle device after this many milliseconds. Defaults to -1 or off.
+ * Idle means every prefetch buffer is topped up and nothing is in flight. A negative value leaves the device's
+ * power/control policy alone, so it can still be set through sysfs.
+ **/
+static int autosuspend_delay = -1;
+module_param(autosuspend_delay, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(autosuspend_delay, "Set the idle time in msecs before the device is autosuspended, negative to leave the power policy alone. Defaults to -1.");
+
+/**
+ * Lever that will set the share of the hwrng path's stream set aside for the kernel pool, in percent. Defaults to 25.
+ * Every transfer hands that share to the pool until its buffer is full, whatever readers of /dev/pico_rng are doing,
+ * so busy readers can't starve the pool. The pool also gets whatever the readers' buffer has no room for.
+ **/
+static int pool_share = 25;
+module_param(pool_share, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(pool_share, "Set the percent of the hwrng path's stream reserved for the kernel pool (0-100). Defaults to 25.");
+
+/**
+ * Levers that will set the refill watermarks of the prefetch buffers in bytes.
+ * Transfers stop once a buffer holds high_watermark bytes and start again when it drains to low_watermark.
+ **/
+static int low_watermark = 4096;
+module_param(low_watermark, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(low_watermark, "Set the fill level in bytes below which the prefetch buffer is topped up again. Defaults to 4096.");
+
+static int high_watermark = 12288;
+module_param(high_watermark, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(high_watermark, "Set the fill level in bytes the prefetch buffer is topped up to. Defaults to 12288.");
+
+/**
+ * A ring shared with userspace through mmap, see pico_rng_uapi.h.
+ * Freed once the last mapping of it is gone.
+ **/
+struct pico_rng_ring {
+	struct pico_rng_ring_header            *header;  // start of the vmalloc_user area, the ring data follows one page in
+	u8                                     *data;
+	u64                                    size;
+	u64                                    head;     // producer index, only ever published to the header page
+	atomic_t                               maps;
+	struct pico_rng_path                   *data_path;
+	struct pico_rng_file                   *owner;   // the file mapped, its vmas keep it open
+};
+
+/**
+ * A batch of a data path's fifo cached on one CPU. lock keeps the readers on that CPU out of each other's way.
+ **/
+struct pico_rng_percpu {
+	struct mutex                           lock;
+	unsigned int                           pos;
+	unsigned int                           len;
+	u8                                     buffer[PICO_RNG_PERCPU_SIZE];
+};
+
+/**
+ * Counters and log2 latency histograms of a data path, shown in debugfs
+ **/
+struct pico_rng_stats {
+	ktime_t                                start;
+	atomic64_t                             urbs;
+	atomic64_t                             urb_bytes;
+	atomic64_t                             reads;
+	atomic64_t                             read_bytes;
+	atomic_t                               urb_hist[PICO_RNG_HIST_BUCKETS];  // USB round trips
+	atomic_t                               read_hist[PICO_RNG_HIST_BUCKETS]; // read() service times
+};
+
+/**
+ * A bulk in endpoint of the device and the URB pipeline prefetching from it.
+ * Completions fill fifo, and while a process has ring mapped they keep fifo at the low watermark and fill ring
+ * with the rest. On the path that feeds hwrng they hand pool its share first, which only the hwrng core reads.
+ * lock protects fifo, pool, ring, idle, running, refilling, suspended and halted, completions take it from interrupt context.
+ **/
+struct pico_rng_path {
+	struct pico_rng_data                   *rng;
+	struct usb_endpoint_descriptor         *endpoint;
+	int                                    pipe;
+	struct urb                             *urbs[PICO_RNG_NUM_URBS];
+	ktime_t                                submitted[PICO_RNG_NUM_URBS];
+	int                                    urb_size;
+	unsigned long                          idle;     // bitmap of the URBs parked until the fifo has room
+	bool                                   running;
+	bool                                   refilling; // cleared at the high watermark, set again at the low watermark
+	bool                                   suspended; // URBs killed for a suspend, submitting resumes the device instead
+	bool                                   halted;    // endpoint stalled, nothing is submitted until clear_halt ran
+	struct work_struct                     clear_halt;
+	unsigned int                           low_watermark;
+	unsigned int                           high_watermark;
+	spinlock_t                             lock;
+	struct mutex                           read_lock; // serialises the readers draining fifo
+	wait_queue_head_t                      wait;
+	DECLARE_KFIFO_PTR(fifo, u8);
+	bool                                   feeds_hwrng;
+	DECLARE_KFIFO_PTR(pool, u8);
+	struct pico_rng_ring                   *ring;
+	struct pico_rng_percpu __percpu        *percpu;
+	struct pico_rng_stats                  stats;
+};
+
+/**
+ * Continuous health test state of the bytes a device feeds hwrng. Only touched from hwrng reads, which the core serialises.
+ **/
+struct pico_rng_health {
+	u8                                     rct_last;
+	unsigned int                           rct_count;
+	unsigned int                           rct_cutoff;
+	u8                                     apt_ref;
+	unsigned int                           apt_count;
+	unsigned int                           apt_seen;
+	unsigned int                           apt_cutoff;
+	unsigned int                           rct_failures;
+	unsigned int                           apt_failures;
+	unsigned int                           clean;    // bytes passed since the last failure
+	bool                                   ok;
+};
+
+/**
+ * The data structure of each Pico, one per probed interface.
+ * Freed by pico_rng_delete() once the device is gone and the last open file and reader let go of it.
  **/
 struct pico_rng_data {
 	struct usb_device                      *dev;
 	struct usb_interface                   *interface;
-	struct usb_endpoint_descriptor         *endpoint;
-	int                                    pipe;
-	struct task_struct                     *rng_task;
-} module_data;
+	struct pico_rng_path                   paths[PICO_RNG_NUM_PATHS];
+	struct hwrng                           hwrng;
+	char                                   hwrng_name[16];
+	bool                                   hwrng_registered;
+	struct pico_rng_health                 health;
+	struct dentry                          *debugfs;
+	struct kref                            kref;
+	struct list_head                       node;     // on pico_rng_devices while plugged in
+};
+
+/**
+ * The data structure of each open file. rng is NULL for the aggregate device.
+ * lock protects the DRBG state, which is only set up once the file switches to PICO_RNG_READ_DRBG.
+ **/
+struct pico_rng_file {
+	struct pico_rng_data                   *rng;
+	struct mutex                           lock;
+	u32                                    read_mode;
+	struct crypto_rng                      *drbg;
+	struct pico_rng_path                   *mapped;        // path whose ring this file has mapped, set under its lock
+	u8                                     *drbg_buffer;   // PICO_RNG_DRBG_CHUNK bytes
+	u64                                    drbg_generated; // bytes since the last reseed
+	unsigned long                          drbg_seeded;    // jiffies of the last reseed
+};
+
+/**
+ * debugfs directory of the module, every Pico gets a pico_rng<n> directory in it
+ **/
+static struct dentry *pico_rng_debugfs;
+
+/**
+ * Every Pico plugged in, in the order the aggregate device reads them
+ **/
+static LIST_HEAD(pico_rng_devices);
+static DEFINE_MUTEX(pico_rng_devices_lock);
+
+/**
+ * Woken along with a data path whenever it gets data or goes away, for pollers of the aggregate device
+ **/
+static DECLARE_WAIT_QUEUE_HEAD(pico_rng_aggregate_wait);
 
 /**
  * Prototype USB Functions
  **/
 static int pico_rng_usb_probe(struct usb_interface *interface, const struct usb_device_id *id);
 static void pico_rng_usb_disconnect(struct usb_interface *interface);
+static int pico_rng_find_paths(struct pico_rng_data *rng, struct usb_host_interface *altsetting);
+static void pico_rng_delete(struct kref *kref);
+static int pico_rng_usb_suspend(struct usb_interface *interface, pm_message_t message);
+static int pico_rng_usb_resume(struct usb_interface *interface);
 
 /**
  * Prototype File Operation Functions
  **/ 
 static int pico_rng_open(struct inode *inode, struct file *file);
-static ssize_t pico_rng_read(struct file *file, char __user *user_buffer, size_t size, loff_t *offset);
+static int pico_rng_release(struct inode *inode, struct file *file);
+static int pico_rng_aggregate_open(struct inode *inode, struct file *file);
+static long pico_rng_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static ssize_t pico_rng_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t pico_rng_aggregate_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static bool pico_rng_iocb_nonblock(struct kiocb *iocb);
+static __poll_t pico_rng_poll(struct file *file, struct poll_table_struct *wait);
+static __poll_t pico_rng_aggregate_poll(struct file *file, struct poll_table_struct *wait);
+static int pico_rng_mmap(struct file *file, struct vm_area_struct *vma);
 
 /**
- * Prototype RNG Kthread Functions
- **/ 
-static int pico_rng_kthread(void *data);
-void pico_rng_kthread_start(void);
-void pico_rng_kthread_stop(void);
+ * Prototype URB pipeline Functions
+ **/
+static int pico_rng_path_start(struct pico_rng_path *data_path);
+static void pico_rng_path_stop(struct pico_rng_path *data_path);
+static void pico_rng_path_free(struct pico_rng_path *data_path);
+static void pico_rng_path_submit(struct pico_rng_path *data_path);
+static void pico_rng_urb_complete(struct urb *urb);
+static void pico_rng_path_fan_out(struct pico_rng_path *data_path, const u8 *buffer, unsigned int count);
+static bool pico_rng_pool_hungry(struct pico_rng_path *data_path);
+static unsigned int pico_rng_fifo_deficit(struct pico_rng_path *data_path);
+static int pico_rng_path_suspend(struct pico_rng_path *data_path, bool autosuspend);
+static void pico_rng_path_resume(struct pico_rng_path *data_path);
+static void pico_rng_path_clear_halt(struct work_struct *work);
+
+/**
+ * Prototype DRBG Functions
+ **/
+static int pico_rng_drbg_start(struct pico_rng_file *pf);
+static void pico_rng_drbg_free(struct pico_rng_file *pf);
+static int pico_rng_drbg_seed(struct pico_rng_file *pf);
+static ssize_t pico_rng_drbg_read(struct pico_rng_file *pf, struct iov_iter *to);
+
+/**
+ * Prototype shared ring Functions
+ **/
+static u64 pico_rng_ring_used(struct pico_rng_ring *ring);
+static void pico_rng_ring_in(struct pico_rng_ring *ring, const u8 *buffer, unsigned int count);
+static void pico_rng_vm_open(struct vm_area_struct *vma);
+static void pico_rng_vm_close(struct vm_area_struct *vma);
+
+/**
+ * Prototype hwrng Functions
+ **/
+static int pico_rng_hwrng_read(struct hwrng *hwrng, void *data, size_t max, bool wait);
+static void pico_rng_hwrng_register(struct pico_rng_data *rng);
+static void pico_rng_hwrng_unregister(struct pico_rng_data *rng);
+static void pico_rng_health_init(struct pico_rng_health *health);
+static bool pico_rng_health_run(struct pico_rng_health *health, const u8 *data, int count);
+
+/**
+ * Prototype debugfs Functions
+ **/
+static void pico_rng_hist_add(atomic_t *hist, ktime_t elapsed);
+static void pico_rng_debugfs_add(struct pico_rng_data *rng);
+static int pico_rng_stats_show(struct seq_file *s, void *unused);
+DEFINE_SHOW_ATTRIBUTE(pico_rng_stats);
 
 /**
  * Prototype module Functions
  **/
-static int pico_rng_read_data(void *buffer, int count);
+static struct pico_rng_path *pico_rng_get_path(struct pico_rng_data *rng, int id);
+static struct pico_rng_data *pico_rng_next_device(bool with_data);
+static void pico_rng_path_refill(struct pico_rng_path *data_path);
+static int pico_rng_wait_data(struct pico_rng_path *data_path, bool nonblock);
+static int pico_rng_read_data(struct pico_rng_path *data_path, void *buffer, int count);
+static int pico_rng_read_pool(struct pico_rng_path *data_path, void *buffer, int count, bool wait);
+static int pico_rng_path_id(struct pico_rng_path *data_path);
+static ssize_t pico_rng_read_fifo(struct pico_rng_path *data_path, struct iov_iter *to, size_t count, bool nonblock);
+static ssize_t pico_rng_read_percpu(struct pico_rng_path *data_path, struct iov_iter *to, size_t count, bool nonblock);
+static int pico_rng_percpu_lock(struct pico_rng_percpu *cache, bool nonblock);
+static ssize_t pico_rng_read_user(struct pico_rng_path *data_path, struct iov_iter *to, size_t count, bool nonblock);
 static int __init pico_rng_driver_init(void);
 static void __exit pico_rng_driver_exit(void);
 module_init(pico_rng_driver_init);
@@ -103,6 +474,10 @@ static struct usb_driver pico_rng_usb_driver = {
 	.id_table       = pico_rng_usb_table,
 	.probe          = pico_rng_usb_probe,
 	.disconnect     = pico_rng_usb_disconnect,
+	.suspend        = pico_rng_usb_suspend,
+	.resume         = pico_rng_usb_resume,
+	.reset_resume   = pico_rng_usb_resume,
+	.supports_autosuspend = 1,
 };
 
 /**
@@ -111,228 +486,1973 @@ static struct usb_driver pico_rng_usb_driver = {
  **/
 static struct file_operations pico_rng_fops = {
 	.owner          = THIS_MODULE,
-	.read           = pico_rng_read,
+	.read_iter      = pico_rng_read_iter,
+	.splice_read    = pico_rng_splice_read,
+	.poll           = pico_rng_poll,
+	.mmap           = pico_rng_mmap,
+	.unlocked_ioctl = pico_rng_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
 	.open           = pico_rng_open,
+	.release        = pico_rng_release,
+};
+
+/**
+ * VM operations data structure for the shared ring mappings
+ **/
+static const struct vm_operations_struct pico_rng_vm_ops = {
+	.open           = pico_rng_vm_open,
+	.close          = pico_rng_vm_close,
 };
 
 /**
- * USB class data structure
+ * USB class data structure, every Pico gets a /dev/pico_rng<n> of its own
  **/
  struct usb_class_driver pico_rng_usb_class = {
-	.name           = "pico_rng",
+	.name           = "pico_rng%d",
 	.fops           = &pico_rng_fops,
 };
 
 /**
- * USB: Probe
- * This method will be called if the device we plug in matches the vid:pid we are listening for
+ * File operations data structure for the aggregate character device
  **/
-static int pico_rng_usb_probe(struct usb_interface *interface, const struct usb_device_id *id)
+static struct file_operations pico_rng_aggregate_fops = {
+	.owner          = THIS_MODULE,
+	.read_iter      = pico_rng_aggregate_read_iter,
+	.splice_read    = pico_rng_splice_read,
+	.poll           = pico_rng_aggregate_poll,
+	.unlocked_ioctl = pico_rng_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+	.open           = pico_rng_aggregate_open,
+	.release        = pico_rng_release,
+};
+
+/**
+ * Misc device data structure for /dev/pico_rng, registered when the aggregate parameter is set
+ **/
+static struct miscdevice pico_rng_aggregate_dev = {
+	.minor          = MISC_DYNAMIC_MINOR,
+	.name           = "pico_rng",
+	.fops           = &pico_rng_aggregate_fops,
+};
+
+/**
+ * USB: Find the data paths
+ * Every bulk in endpoint is a data path of its own, numbered after its endpoint number.
+ * Older firmware only has EP1.
+ **/
+static int pico_rng_find_paths(struct pico_rng_data *rng, struct usb_host_interface *altsetting)
 {
-	int retval = -ENODEV;
+	int i;
+	int id;
+	struct usb_endpoint_descriptor *endpoint;
 
-	module_data.dev = interface_to_usbdev(interface);
-	if(!module_data.dev)
+	for(i = 0; i < altsetting->desc.bNumEndpoints; i++)
 	{
-		LOGGER_ERR("Unable to locate usb device\n");
-		return retval;
+		endpoint = &altsetting->endpoint[i].desc;
+		if(!usb_endpoint_is_bulk_in(endpoint))
+		{
+			continue;
+		}
+
+		id = usb_endpoint_num(endpoint) - 1;
+		if(id < 0 || id >= PICO_RNG_NUM_PATHS)
+		{
+			LOGGER_WARN("Ignoring unknown bulk endpoint 0x%x\n", endpoint->bEndpointAddress);
+			continue;
+		}
+
+		rng->paths[id].rng = rng;
+		rng->paths[id].endpoint = endpoint;
+		rng->paths[id].pipe = usb_rcvbulkpipe(rng->dev, endpoint->bEndpointAddress);
+		LOGGER_DEBUG("path %d endpoint found %p with pipe %d\n", id, endpoint, rng->paths[id].pipe);
 	}
 
-	module_data.interface = interface;
-	if(!module_data.interface)
+	if(!rng->paths[PICO_RNG_PATH_SELECTED].endpoint)
 	{
-		LOGGER_ERR("Invalid interface\n");
-		return retval;
+		return -ENXIO;
 	}
 
-	retval = usb_find_bulk_in_endpoint(module_data.interface->cur_altsetting, &(module_data.endpoint));
-	if(retval)
+	return 0;
+}
+
+/**
+ * Look up a data path, falling back to EP1 if the device doesn't have it
+ **/
+static struct pico_rng_path *pico_rng_get_path(struct pico_rng_data *rng, int id)
+{
+	if(id < 0 || id >= PICO_RNG_NUM_PATHS || !rng->paths[id].endpoint)
 	{
-        LOGGER_ERR("Unable to find bulk endpoint %d\n", retval);
-		return(retval);
-    }
+		id = PICO_RNG_PATH_SELECTED;
+	}
+
+	return &rng->paths[id];
+}
 
-	module_data.pipe = usb_rcvbulkpipe(module_data.dev, module_data.endpoint->bEndpointAddress);
+/**
+ * Start the URB pipeline of every data path the device has
+ **/
+static int pico_rng_paths_start(struct pico_rng_data *rng)
+{
+	int i;
+	int retval;
 
-	LOGGER_DEBUG("endpoint found %p with pipe %d\n", module_data.endpoint, module_data.pipe);
+	// Only the raw extracted bits carry the entropy credited, the conditioned stream is stretched from a few of them
+	pico_rng_get_path(rng, PICO_RNG_PATH_RAW)->feeds_hwrng = true;
 
-	retval = usb_register_dev(module_data.interface, &pico_rng_usb_class);
-	if(retval)
+	for(i = 0; i < PICO_RNG_NUM_PATHS; i++)
 	{
-		LOGGER_ERR("not able to get a minor for this device\n");
-		return -1;
-	}
+		if(!rng->paths[i].endpoint)
+		{
+			continue;
+		}
 
-	pico_rng_kthread_start();
+		retval = pico_rng_path_start(&rng->paths[i]);
+		if(retval)
+		{
+			LOGGER_ERR("Unable to start the pipeline of path %d\n", i);
+			while(--i >= 0)
+			{
+				if(rng->paths[i].endpoint)
+				{
+					pico_rng_path_stop(&rng->paths[i]);
+				}
+			}
+			return retval;
+		}
+	}
 
-	return retval;
+	return 0;
 }
 
 /**
- * USB:disconnect
- * This method is used to cleanup everything after the device is disconnected
+ * Stop the URB pipeline of every data path
  **/
-static void pico_rng_usb_disconnect(struct usb_interface *interface)
+static void pico_rng_paths_stop(struct pico_rng_data *rng)
 {
-	LOGGER_INFO("pico rng usb device disconnected\n");
-	pico_rng_kthread_stop();
-	usb_deregister_dev(module_data.interface, &pico_rng_usb_class);
-	module_data.dev = NULL;
-	module_data.interface = NULL;
-	module_data.pipe = 0;
-}
+	int i;
 
+	for(i = 0; i < PICO_RNG_NUM_PATHS; i++)
+	{
+		if(rng->paths[i].endpoint)
+		{
+			pico_rng_path_stop(&rng->paths[i]);
+		}
+	}
+}
 
 /**
- * File:open
- * Does nothing, just here as a place holder
+ * Release a device once nothing refers to it anymore
  **/
-static int pico_rng_open(struct inode *inode, struct file *file)
+static void pico_rng_delete(struct kref *kref)
 {
-	LOGGER_DEBUG("inside pico_rng_open with inode %p file %p\n", inode, file);
-	return 0;
+	int i;
+	struct pico_rng_data *rng = container_of(kref, struct pico_rng_data, kref);
+
+	for(i = 0; i < PICO_RNG_NUM_PATHS; i++)
+	{
+		pico_rng_path_free(&rng->paths[i]);
+	}
+
+	usb_put_intf(rng->interface);
+	usb_put_dev(rng->dev);
+	kfree(rng);
 }
 
 /**
- * File:read
- * Calls pico_rng_read_data() and returns module_data.endpoint->wMaxPacketSize bytes of data back to the user
+ * USB: Probe
+ * This method will be called if the device we plug in matches the vid:pid we are listening for
  **/
-static ssize_t pico_rng_read(struct file *file, char __user *user_buffer, size_t size, loff_t *offset)
+static int pico_rng_usb_probe(struct usb_interface *interface, const struct usb_device_id *id)
 {
-    int bytes_read = 0;
-	void *buffer = NULL;
+	int retval = -ENODEV;
+	struct pico_rng_data *rng;
+
+	rng = kzalloc(sizeof(*rng), GFP_KERNEL);
+	if(!rng)
+	{
+		LOGGER_ERR("Failed to allocate device data\n");
+		return -ENOMEM;
+	}
 
-	LOGGER_DEBUG("inside pico_rng_read with file %p, user_buffer %p, size %ld, offset %lld\n", file, user_buffer, size, *offset);
+	kref_init(&rng->kref);
+	INIT_LIST_HEAD(&rng->node);
+	rng->dev = usb_get_dev(interface_to_usbdev(interface));
+	rng->interface = usb_get_intf(interface);
 
-    buffer = kmalloc(module_data.endpoint->wMaxPacketSize, GFP_USER);
-	if(!buffer)
+	retval = pico_rng_find_paths(rng, interface->cur_altsetting);
+	if(retval)
 	{
-		LOGGER_ERR("Failed to allocate buffer\n");
-		return -EFAULT;
+        LOGGER_ERR("Unable to find bulk endpoint %d\n", retval);
+		goto error;
+    }
+
+	retval = pico_rng_paths_start(rng);
+	if(retval)
+	{
+		goto error;
 	}
 
-	bytes_read = pico_rng_read_data(buffer, module_data.endpoint->wMaxPacketSize);
-	if(!bytes_read)
+	mutex_lock(&pico_rng_devices_lock);
+	usb_set_intfdata(interface, rng);
+	list_add_tail(&rng->node, &pico_rng_devices);
+	mutex_unlock(&pico_rng_devices_lock);
+
+	retval = usb_register_dev(interface, &pico_rng_usb_class);
+	if(retval)
 	{
-		LOGGER_ERR("Failed to read data\n");
-		return -EFAULT;
+		LOGGER_ERR("not able to get a minor for this device\n");
+		mutex_lock(&pico_rng_devices_lock);
+		list_del_init(&rng->node);
+		usb_set_intfdata(interface, NULL);
+		mutex_unlock(&pico_rng_devices_lock);
+		pico_rng_paths_stop(rng);
+		goto error;
 	}
 
-    LOGGER_DEBUG("Copying %d bytest of random data to userspace with offset %lld\n", bytes_read, *offset);
-	if(copy_to_user(user_buffer, buffer, bytes_read))
+	LOGGER_INFO("pico rng usb device attached to minor %d\n", interface->minor);
+
+	pico_rng_hwrng_register(rng);
+	pico_rng_debugfs_add(rng);
+
+	if(autosuspend_delay >= 0)
 	{
-        return -EFAULT;
+		pm_runtime_set_autosuspend_delay(&rng->dev->dev, autosuspend_delay);
+		usb_enable_autosuspend(rng->dev);
 	}
-	
-	kfree(buffer);
-    return bytes_read;
+
+	return 0;
+
+error:
+	kref_put(&rng->kref, pico_rng_delete);
+	return retval;
 }
 
+/**
+ * USB:disconnect
+ * This method is used to cleanup everything after the device is disconnected.
+ * Readers still holding the device see -ENODEV and the aggregate device carries on with the others.
+ **/
+static void pico_rng_usb_disconnect(struct usb_interface *interface)
+{
+	struct pico_rng_data *rng = usb_get_intfdata(interface);
+
+	LOGGER_INFO("pico rng usb device on minor %d disconnected\n", interface->minor);
 
-/*
- * Pico rng thread that periodically adds hardware randomness
- */
-static int pico_rng_kthread(void *data)
+	// Once off the list and out of the interface nothing new can get hold of it
+	mutex_lock(&pico_rng_devices_lock);
+	list_del_init(&rng->node);
+	usb_set_intfdata(interface, NULL);
+	mutex_unlock(&pico_rng_devices_lock);
+
+	debugfs_remove_recursive(rng->debugfs);
+	pico_rng_hwrng_unregister(rng);
+	usb_deregister_dev(interface, &pico_rng_usb_class);
+	pico_rng_paths_stop(rng);
+
+	kref_put(&rng->kref, pico_rng_delete);
+}
+
+/**
+ * USB: Suspend
+ * Parks the URB pipelines. An autosuspend is refused while anything is in flight, so the device only sleeps
+ * with its prefetch buffers topped up, and those cover the reads that come in while it resumes.
+ **/
+static int pico_rng_usb_suspend(struct usb_interface *interface, pm_message_t message)
 {
-    int bytes_read;
-	void *buffer = NULL;
+	int i;
+	int retval;
+	struct pico_rng_data *rng = usb_get_intfdata(interface);
 
-	buffer = kmalloc(module_data.endpoint->wMaxPacketSize, GFP_NOWAIT);
-	if(!buffer)
+	if(!rng)
 	{
-		LOGGER_ERR("RNG kthread failed to allocate buffer\n");
-		return -EFAULT;
+		return 0;
 	}
 
-	while (!kthread_should_stop())
+	for(i = 0; i < PICO_RNG_NUM_PATHS; i++)
 	{
-		bytes_read = pico_rng_read_data(buffer, module_data.endpoint->wMaxPacketSize);
-		if(!bytes_read)
+		if(!rng->paths[i].endpoint)
 		{
-			LOGGER_ERR("Failed to read data\n");
-
-			// sleep for at least a second, max 2 seconds
-			usleep_range(1000000, 2000000);
-
 			continue;
 		}
 
-        LOGGER_DEBUG("Adding hardware randomness\n");
-		// I would not exactly call this rng as trusted, so it will not add entropy, only random bits to the pool
-		// A trusted device would call add_hwgenerator_randomness and credit the entropy pool. For now the credit is 0 while still adding random bits.
-		add_hwgenerator_randomness(buffer, bytes_read, 0);
-		LOGGER_DEBUG("Randomness added\n");
+		retval = pico_rng_path_suspend(&rng->paths[i], PMSG_IS_AUTO(message));
+		if(retval)
+		{
+			while(--i >= 0)
+			{
+				if(rng->paths[i].endpoint)
+				{
+					pico_rng_path_resume(&rng->paths[i]);
+				}
+			}
+			return retval;
+		}
 	}
 
-    return 0;
+	LOGGER_DEBUG("pico rng usb device on minor %d suspended\n", interface->minor);
+	return 0;
 }
 
 /**
- * Start the rng thread
+ * USB: Resume
+ * Puts the URB pipelines back in flight where readers left them
  **/
-void pico_rng_kthread_start()
+static int pico_rng_usb_resume(struct usb_interface *interface)
 {
-    module_data.rng_task = kthread_run(pico_rng_kthread, &module_data, "pico_rng_thread");
-	if(IS_ERR(module_data.rng_task))
+	int i;
+	struct pico_rng_data *rng = usb_get_intfdata(interface);
+
+	if(!rng)
+	{
+		return 0;
+	}
+
+	usb_mark_last_busy(rng->dev);
+
+	for(i = 0; i < PICO_RNG_NUM_PATHS; i++)
 	{
-        module_data.rng_task = NULL;
-		LOGGER_ERR("Failed to launch the pico rng task\n");
+		if(rng->paths[i].endpoint)
+		{
+			pico_rng_path_resume(&rng->paths[i]);
+		}
 	}
+
+	LOGGER_DEBUG("pico rng usb device on minor %d resumed\n", interface->minor);
+	return 0;
 }
 
+
 /**
- * Stop the rng thread
+ * Set up the data structure of an open file, reading from rng or from every Pico when NULL
  **/
-void pico_rng_kthread_stop()
+static int pico_rng_file_init(struct file *file, struct pico_rng_data *rng)
 {
-	if(module_data.rng_task)
+	struct pico_rng_file *pf;
+
+	pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+	if(!pf)
 	{
-		kthread_stop(module_data.rng_task);
-		module_data.rng_task = NULL;
+		return -ENOMEM;
 	}
+
+	pf->rng = rng;
+	pf->read_mode = PICO_RNG_READ_DEVICE;
+	mutex_init(&pf->lock);
+
+	file->private_data = pf;
+	return 0;
 }
 
 /**
- * Read data from the pico rng. 
- * Fills the buffer and returns the number of bytes filled.
- * Count  is the maximum number of bytes the buffer can hold.
- */
-static int pico_rng_read_data(void *buffer, int count)
+ * File:open
+ * Looks up the device behind the minor and holds on to it until the file is released
+ **/
+static int pico_rng_open(struct inode *inode, struct file *file)
 {
-    int retval = 0;
-	int actual_length = 0;
+	int retval;
+	struct usb_interface *interface;
+	struct pico_rng_data *rng;
 
-    // int usb_bulk_msg(struct usb_device *usb_dev, unsigned int pipe, void *data, int len, int *actual_length, int timeout)
-	LOGGER_DEBUG("Calling usb_bulk_msg dev %p, pipe %u, buffer %p, size %d, and timeout %d", \
-	        module_data.dev, module_data.pipe, buffer, count, timeout);
+	LOGGER_DEBUG("inside pico_rng_open with inode %p file %p\n", inode, file);
 
-    retval = usb_bulk_msg(module_data.dev, 
-	                      module_data.pipe,
-						  buffer,
-						  count,
-						  &actual_length,
-						  timeout);
-	
-	if(retval)
+	// The devices lock keeps disconnect from dropping the device between the lookup and kref_get
+	mutex_lock(&pico_rng_devices_lock);
+
+	interface = usb_find_interface(&pico_rng_usb_driver, iminor(inode));
+	rng = interface ? usb_get_intfdata(interface) : NULL;
+	if(!rng)
 	{
-		return -EFAULT;
+		mutex_unlock(&pico_rng_devices_lock);
+		return -ENODEV;
 	}
 
-    return actual_length;
-}
+	kref_get(&rng->kref);
+	mutex_unlock(&pico_rng_devices_lock);
 
-/**
- * Module:init
+	retval = pico_rng_file_init(file, rng);
+	if(retval)
+	{
+		kref_put(&rng->kref, pico_rng_delete);
+	}
+
+	return retval;
+}
+
+/**
+ * File:open of the aggregate device
+ **/
+static int pico_rng_aggregate_open(struct inode *inode, struct file *file)
+{
+	LOGGER_DEBUG("inside pico_rng_aggregate_open with inode %p file %p\n", inode, file);
+	return pico_rng_file_init(file, NULL);
+}
+
+/**
+ * File:release
+ **/
+static int pico_rng_release(struct inode *inode, struct file *file)
+{
+	struct pico_rng_file *pf = file->private_data;
+
+	pico_rng_drbg_free(pf);
+
+	if(pf->rng)
+	{
+		kref_put(&pf->rng->kref, pico_rng_delete);
+	}
+
+	kfree(pf);
+	return 0;
+}
+
+/**
+ * File:ioctl
+ * Switches the file between reading the Pico and reading a DRBG seeded from it, see pico_rng_uapi.h
+ **/
+static long pico_rng_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	int retval = 0;
+	u32 mode;
+	struct pico_rng_file *pf = file->private_data;
+
+	switch(cmd)
+	{
+		case PICO_RNG_IOC_SET_READ_MODE:
+			if(get_user(mode, (u32 __user *)arg))
+			{
+				return -EFAULT;
+			}
+
+			if(mode != PICO_RNG_READ_DEVICE && mode != PICO_RNG_READ_DRBG)
+			{
+				return -EINVAL;
+			}
+
+			mutex_lock(&pf->lock);
+			if(mode == PICO_RNG_READ_DRBG && !pf->drbg)
+			{
+				retval = pico_rng_drbg_start(pf);
+			}
+			if(!retval)
+			{
+				pf->read_mode = mode;
+			}
+			mutex_unlock(&pf->lock);
+
+			return retval;
+
+		case PICO_RNG_IOC_GET_READ_MODE:
+			return put_user(pf->read_mode, (u32 __user *)arg);
+
+		default:
+			return -ENOTTY;
+	}
+}
+
+/**
+ * File:read_iter
+ * Calls pico_rng_read_user() on the path selected by the path parameter and returns
+ * up to the size of the iterator in data back to the user, capped by the max_read parameter.
+ * Backs read(2), readv(2) and, through pico_rng_splice_read, splice(2) and sendfile(2).
+ **/
+static ssize_t pico_rng_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct pico_rng_file *pf = iocb->ki_filp->private_data;
+
+	LOGGER_DEBUG("inside pico_rng_read_iter with file %p, size %zu\n", iocb->ki_filp, iov_iter_count(to));
+
+	iov_iter_truncate(to, max(max_read, 1));
+
+	if(pf->read_mode == PICO_RNG_READ_DRBG)
+	{
+		return pico_rng_drbg_read(pf, to);
+	}
+
+	return pico_rng_read_user(pico_rng_get_path(pf->rng, path), to, iov_iter_count(to), pico_rng_iocb_nonblock(iocb));
+}
+
+/**
+ * Whether a read may not wait on the device
+ **/
+static bool pico_rng_iocb_nonblock(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/**
+ * File:poll
+ * Readable as soon as the prefetch buffer holds data, hung up once the device is gone.
+ * The file that mapped the shared ring is only readable once the ring holds data, the fifo kept topped up
+ * for other readers doesn't count. Its process polls once the ring runs dry, which also restarts transfers
+ * parked while the ring was full.
+ **/
+static __poll_t pico_rng_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct pico_rng_file *pf = file->private_data;
+	struct pico_rng_path *data_path = READ_ONCE(pf->mapped);
+	unsigned long flags;
+	__poll_t mask = 0;
+
+	if(!data_path)
+	{
+		data_path = pico_rng_get_path(pf->rng, path);
+	}
+
+	poll_wait(file, &data_path->wait, wait);
+	pico_rng_path_refill(data_path);
+
+	spin_lock_irqsave(&data_path->lock, flags);
+	if(pf->mapped == data_path && data_path->ring)
+	{
+		if(pico_rng_ring_used(data_path->ring))
+		{
+			mask |= EPOLLIN | EPOLLRDNORM;
+		}
+	}
+	else if(!kfifo_is_empty(&data_path->fifo))
+	{
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	spin_unlock_irqrestore(&data_path->lock, flags);
+
+	if(pf->read_mode == PICO_RNG_READ_DRBG)
+	{
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	if(!data_path->running)
+	{
+		mask |= EPOLLHUP | EPOLLERR;
+	}
+
+	return mask;
+}
+
+/**
+ * Pick the next device for the aggregate device to read from and take a reference to it.
+ * With with_data only devices with something prefetched count.
+ * The device picked goes to the back of the list, so successive reads go round robin.
+ **/
+static struct pico_rng_data *pico_rng_next_device(bool with_data)
+{
+	struct pico_rng_data *rng;
+	struct pico_rng_data *found = NULL;
+
+	mutex_lock(&pico_rng_devices_lock);
+
+	list_for_each_entry(rng, &pico_rng_devices, node)
+	{
+		if(with_data && kfifo_is_empty(&pico_rng_get_path(rng, path)->fifo))
+		{
+			continue;
+		}
+
+		found = rng;
+		break;
+	}
+
+	if(found)
+	{
+		list_move_tail(&found->node, &pico_rng_devices);
+		kref_get(&found->kref);
+	}
+
+	mutex_unlock(&pico_rng_devices_lock);
+
+	return found;
+}
+
+/**
+ * File:read_iter of the aggregate device
+ * Stripes the read over every Pico, taking whatever each one has prefetched in turn.
+ * Only waits on a device once none of them has anything, unless opened O_NONBLOCK, and then only for
+ * its first data. Skips over one that goes away mid read.
+ **/
+static ssize_t pico_rng_aggregate_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	bool waiting;
+	size_t size;
+	size_t count;
+	size_t total = 0;
+	ssize_t retval = -ENODEV;
+	struct pico_rng_data *rng;
+	struct pico_rng_path *data_path;
+	bool nonblock = pico_rng_iocb_nonblock(iocb);
+	struct pico_rng_file *pf = iocb->ki_filp->private_data;
+
+	LOGGER_DEBUG("inside pico_rng_aggregate_read_iter with file %p, size %zu\n", iocb->ki_filp, iov_iter_count(to));
+
+	iov_iter_truncate(to, max(max_read, 1));
+	size = iov_iter_count(to);
+
+	if(pf->read_mode == PICO_RNG_READ_DRBG)
+	{
+		return pico_rng_drbg_read(pf, to);
+	}
+
+	while(total < size)
+	{
+		waiting = false;
+		rng = pico_rng_next_device(true);
+		if(!rng && nonblock)
+		{
+			mutex_lock(&pico_rng_devices_lock);
+			retval = list_empty(&pico_rng_devices) ? -ENODEV : -EAGAIN;
+			mutex_unlock(&pico_rng_devices_lock);
+			break;
+		}
+		if(!rng)
+		{
+			waiting = true;
+			rng = pico_rng_next_device(false);
+		}
+		if(!rng)
+		{
+			retval = -ENODEV;
+			break;
+		}
+
+		// A device waited on only serves what arrived first, the rest of the read goes round robin again
+		data_path = pico_rng_get_path(rng, path);
+		retval = waiting ? pico_rng_wait_data(data_path, false) : 0;
+		if(!retval)
+		{
+			count = min_t(size_t, size - total, kfifo_len(&data_path->fifo));
+			retval = count ? pico_rng_read_user(data_path, to, count, nonblock) : 0;
+		}
+		kref_put(&rng->kref, pico_rng_delete);
+
+		if(retval == -ENODEV)
+		{
+			// Unplugged under us, the others carry on
+			continue;
+		}
+		if(retval < 0)
+		{
+			break;
+		}
+
+		total += retval;
+	}
+
+	return total ? total : retval;
+}
+
+/**
+ * File:poll of the aggregate device
+ * Readable as soon as any Pico has data prefetched, hung up while none is plugged in
+ **/
+static __poll_t pico_rng_aggregate_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct pico_rng_file *pf = file->private_data;
+	struct pico_rng_data *rng;
+	__poll_t mask = 0;
+
+	poll_wait(file, &pico_rng_aggregate_wait, wait);
+
+	if(pf->read_mode == PICO_RNG_READ_DRBG)
+	{
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	mutex_lock(&pico_rng_devices_lock);
+
+	if(list_empty(&pico_rng_devices))
+	{
+		mask |= EPOLLHUP;
+	}
+
+	list_for_each_entry(rng, &pico_rng_devices, node)
+	{
+		if(!kfifo_is_empty(&pico_rng_get_path(rng, path)->fifo))
+		{
+			mask |= EPOLLIN | EPOLLRDNORM;
+			break;
+		}
+	}
+
+	mutex_unlock(&pico_rng_devices_lock);
+
+	return mask;
+}
+
+/**
+ * Allocate the DRBG of a file and seed it. Called with the file lock held.
+ **/
+static int pico_rng_drbg_start(struct pico_rng_file *pf)
+{
+	int retval;
+
+	pf->drbg = crypto_alloc_rng(drbg_name, 0, 0);
+	if(IS_ERR(pf->drbg))
+	{
+		retval = PTR_ERR(pf->drbg);
+		LOGGER_ERR("Failed to allocate rng %s %d\n", drbg_name, retval);
+		pf->drbg = NULL;
+		return retval;
+	}
+
+	pf->drbg_buffer = kmalloc(PICO_RNG_DRBG_CHUNK, GFP_KERNEL);
+	if(!pf->drbg_buffer)
+	{
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	retval = pico_rng_drbg_seed(pf);
+	if(retval)
+	{
+		goto error;
+	}
+
+	return 0;
+
+error:
+	pico_rng_drbg_free(pf);
+	return retval;
+}
+
+/**
+ * Release the DRBG of a file, if it has one
+ **/
+static void pico_rng_drbg_free(struct pico_rng_file *pf)
+{
+	if(pf->drbg)
+	{
+		crypto_free_rng(pf->drbg);
+		pf->drbg = NULL;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	kfree_sensitive(pf->drbg_buffer);
+#else
+	kzfree(pf->drbg_buffer);
+#endif
+	pf->drbg_buffer = NULL;
+}
+
+/**
+ * (Re)seed the DRBG of a file with PICO_RNG_DRBG_SEED_SIZE bytes of the conditioned path of its Pico,
+ * or of the next Pico in turn for the aggregate device. The kernel DRBGs mix their own seed source in as well.
+ * Called with the file lock held.
+ **/
+static int pico_rng_drbg_seed(struct pico_rng_file *pf)
+{
+	int retval = 0;
+	int filled = 0;
+	u8 seed[PICO_RNG_DRBG_SEED_SIZE];
+	struct pico_rng_data *rng = pf->rng;
+
+	if(rng)
+	{
+		kref_get(&rng->kref);
+	}
+	else
+	{
+		rng = pico_rng_next_device(false);
+		if(!rng)
+		{
+			return -ENODEV;
+		}
+	}
+
+	while(filled < sizeof(seed))
+	{
+		retval = pico_rng_read_data(pico_rng_get_path(rng, PICO_RNG_PATH_CONDITIONED), seed + filled, sizeof(seed) - filled);
+		if(retval < 0)
+		{
+			break;
+		}
+		filled += retval;
+		retval = 0;
+	}
+
+	kref_put(&rng->kref, pico_rng_delete);
+
+	if(!retval)
+	{
+		retval = crypto_rng_reset(pf->drbg, seed, sizeof(seed));
+	}
+	memzero_explicit(seed, sizeof(seed));
+
+	if(retval)
+	{
+		LOGGER_ERR("Failed to seed the drbg %d\n", retval);
+		return retval;
+	}
+
+	pf->drbg_generated = 0;
+	pf->drbg_seeded = jiffies;
+	return 0;
+}
+
+/**
+ * Read from the DRBG of a file, reseeding it from the Pico whenever drbg_reseed_bytes or drbg_reseed_ms ran out.
+ * Bounded by the CPU rather than USB. Returns the number of bytes copied or a negative error.
+ **/
+static ssize_t pico_rng_drbg_read(struct pico_rng_file *pf, struct iov_iter *to)
+{
+	int retval = 0;
+	size_t total = 0;
+	size_t count = iov_iter_count(to);
+	size_t chunk;
+
+	retval = mutex_lock_interruptible(&pf->lock);
+	if(retval)
+	{
+		return retval;
+	}
+
+	while(total < count)
+	{
+		if(pf->drbg_generated >= drbg_reseed_bytes ||
+		   time_after(jiffies, pf->drbg_seeded + msecs_to_jiffies(drbg_reseed_ms)))
+		{
+			retval = pico_rng_drbg_seed(pf);
+			if(retval)
+			{
+				break;
+			}
+		}
+
+		chunk = min_t(size_t, count - total, PICO_RNG_DRBG_CHUNK);
+		retval = crypto_rng_get_bytes(pf->drbg, pf->drbg_buffer, chunk);
+		if(retval)
+		{
+			break;
+		}
+
+		if(copy_to_iter(pf->drbg_buffer, chunk, to) != chunk)
+		{
+			retval = -EFAULT;
+			break;
+		}
+
+		pf->drbg_generated += chunk;
+		total += chunk;
+
+		if(signal_pending(current))
+		{
+			retval = -ERESTARTSYS;
+			break;
+		}
+		cond_resched();
+	}
+
+	memzero_explicit(pf->drbg_buffer, PICO_RNG_DRBG_CHUNK);
+	mutex_unlock(&pf->lock);
+
+	return total ? total : retval;
+}
+
+/**
+ * File:mmap
+ * Maps a header page and a ring of mmap_size bytes the URB completions write into directly,
+ * see pico_rng_uapi.h. One mapping per data path at a time, it has to be shared and cover the whole ring.
+ **/
+static int pico_rng_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int retval;
+	unsigned long flags;
+	struct pico_rng_file *pf = file->private_data;
+	struct pico_rng_path *data_path = pico_rng_get_path(pf->rng, path);
+	struct pico_rng_ring *ring;
+	u64 size = rounddown_pow_of_two(max_t(unsigned long, mmap_size, PAGE_SIZE));
+
+	if(vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE + size || !(vma->vm_flags & VM_SHARED))
+	{
+		return -EINVAL;
+	}
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if(!ring)
+	{
+		return -ENOMEM;
+	}
+
+	ring->header = vmalloc_user(PAGE_SIZE + size);
+	if(!ring->header)
+	{
+		kfree(ring);
+		return -ENOMEM;
+	}
+
+	ring->data = (u8 *)ring->header + PAGE_SIZE;
+	ring->size = size;
+	ring->data_path = data_path;
+	ring->owner = pf;
+	atomic_set(&ring->maps, 1);
+	ring->header->version = PICO_RNG_RING_VERSION;
+	ring->header->data_offset = PAGE_SIZE;
+	ring->header->size = size;
+
+	retval = remap_vmalloc_range(vma, ring->header, 0);
+	if(retval)
+	{
+		goto error;
+	}
+
+	spin_lock_irqsave(&data_path->lock, flags);
+	if(data_path->ring || !data_path->running)
+	{
+		retval = data_path->running ? -EBUSY : -ENODEV;
+		spin_unlock_irqrestore(&data_path->lock, flags);
+		goto error;
+	}
+	data_path->ring = ring;
+	pf->mapped = data_path;
+	spin_unlock_irqrestore(&data_path->lock, flags);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP);
+#else
+	vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+	vma->vm_ops = &pico_rng_vm_ops;
+	vma->vm_private_data = ring;
+
+	// The ring starts out empty, so whatever was parked on the fifo can go now
+	pico_rng_path_refill(data_path);
+
+	return 0;
+
+error:
+	// The pages mapped so far hold their own references, they go with the vma
+	vfree(ring->header);
+	kfree(ring);
+	return retval;
+}
+
+/**
+ * VM:open
+ * The mapping was split, each part keeps the ring alive
+ **/
+static void pico_rng_vm_open(struct vm_area_struct *vma)
+{
+	struct pico_rng_ring *ring = vma->vm_private_data;
+
+	atomic_inc(&ring->maps);
+}
+
+/**
+ * VM:close
+ * Once the last mapping is gone the data path goes back to filling its fifo
+ **/
+static void pico_rng_vm_close(struct vm_area_struct *vma)
+{
+	unsigned long flags;
+	struct pico_rng_ring *ring = vma->vm_private_data;
+	struct pico_rng_path *data_path = ring->data_path;
+
+	if(!atomic_dec_and_test(&ring->maps))
+	{
+		return;
+	}
+
+	spin_lock_irqsave(&data_path->lock, flags);
+	data_path->ring = NULL;
+	ring->owner->mapped = NULL;
+	spin_unlock_irqrestore(&data_path->lock, flags);
+
+	pico_rng_path_refill(data_path);
+
+	vfree(ring->header);
+	kfree(ring);
+}
+
+/**
+ * Bytes in the shared ring userspace hasn't consumed yet.
+ * A tail userspace moved past head or too far behind it counts as a full ring, so nothing unread is overwritten.
+ **/
+static u64 pico_rng_ring_used(struct pico_rng_ring *ring)
+{
+	u64 used = ring->head - READ_ONCE(ring->header->tail);
+
+	return used > ring->size ? ring->size : used;
+}
+
+/**
+ * Append to the shared ring, dropping whatever doesn't fit. Called with the path lock held.
+ **/
+static void pico_rng_ring_in(struct pico_rng_ring *ring, const u8 *buffer, unsigned int count)
+{
+	u64 offset = ring->head & (ring->size - 1);
+	unsigned int first;
+
+	count = min_t(u64, count, ring->size - pico_rng_ring_used(ring));
+	first = min_t(u64, count, ring->size - offset);
+
+	memcpy(ring->data + offset, buffer, first);
+	memcpy(ring->data, buffer + first, count - first);
+
+	// Publish the data before the head that covers it. Userspace can scribble over the header, so the
+	// head it reads back is never trusted.
+	ring->head += count;
+	smp_store_release(&ring->header->head, ring->head);
+}
+
+/**
+ * hwrng:read
+ * Serves the pool share of the raw path, EP1 on older firmware, so the kernel doesn't compete
+ * with the character devices for packets and the health tests see the noise source itself.
+ * Only waits on the device when the hwrng core allows it. Everything read goes through the health tests. The hwrng core takes the credit of a device once, when it
+ * starts using it, so while the tests fail nothing is handed over at all rather than handing it over uncredited.
+ **/
+static int pico_rng_hwrng_read(struct hwrng *hwrng, void *data, size_t max, bool wait)
+{
+	int retval;
+	int budget = 2 * PICO_RNG_HEALTH_RECOVER; // bytes tested in one call while recovering
+	struct pico_rng_data *rng = container_of(hwrng, struct pico_rng_data, hwrng);
+	struct pico_rng_path *data_path = pico_rng_get_path(rng, PICO_RNG_PATH_RAW);
+
+	do
+	{
+		retval = pico_rng_read_pool(data_path, data, min_t(size_t, max, INT_MAX), wait);
+		if(retval <= 0)
+		{
+			return retval;
+		}
+
+		if(pico_rng_health_run(&rng->health, data, retval))
+		{
+			return retval;
+		}
+
+		budget -= retval;
+	}
+	while(wait && budget > 0);
+
+	// Keep the rejected bytes out of the hwrng core's buffer
+	memzero_explicit(data, retval);
+	return 0;
+}
+
+/**
+ * Set up the health tests for credit_bits of min-entropy per byte, at a false positive rate of 2^-20
+ **/
+static void pico_rng_health_init(struct pico_rng_health *health)
+{
+	// 1 + CRITBINOM(512, 2^-H, 1 - 2^-20), indexed by H
+	static const unsigned int apt_cutoffs[] = { 0, 311, 177, 103, 62, 39, 25, 18, 13 };
+	unsigned int entropy = clamp_t(unsigned int, credit_bits, 1, 8);
+
+	memset(health, 0, sizeof(*health));
+	health->rct_cutoff = 1 + DIV_ROUND_UP(20, entropy);
+	health->apt_cutoff = apt_cutoffs[entropy];
+	health->apt_seen = PICO_RNG_HEALTH_APT_WINDOW;
+	health->clean = PICO_RNG_HEALTH_RECOVER;
+	health->ok = true;
+}
+
+/**
+ * Run the Repetition Count and Adaptive Proportion Tests over a batch of bytes.
+ * Returns whether the batch may be handed on, false from a failure until PICO_RNG_HEALTH_RECOVER clean bytes later.
+ **/
+static bool pico_rng_health_run(struct pico_rng_health *health, const u8 *data, int count)
+{
+	int i;
+	bool failed = false;
+
+	for(i = 0; i < count; i++)
+	{
+		if(health->rct_count && data[i] == health->rct_last)
+		{
+			if(++health->rct_count >= health->rct_cutoff)
+			{
+				health->rct_failures++;
+				health->rct_count = 0;
+				failed = true;
+			}
+		}
+		else
+		{
+			health->rct_last = data[i];
+			health->rct_count = 1;
+		}
+
+		if(health->apt_seen == PICO_RNG_HEALTH_APT_WINDOW)
+		{
+			health->apt_ref = data[i];
+			health->apt_count = 1;
+			health->apt_seen = 1;
+		}
+		else
+		{
+			health->apt_seen++;
+			if(data[i] == health->apt_ref && ++health->apt_count >= health->apt_cutoff)
+			{
+				health->apt_failures++;
+				health->apt_seen = PICO_RNG_HEALTH_APT_WINDOW;
+				failed = true;
+			}
+		}
+	}
+
+	if(failed)
+	{
+		if(health->ok)
+		{
+			LOGGER_WARN("health tests failed (rct %u, apt %u), no longer crediting the kernel\n", health->rct_failures, health->apt_failures);
+		}
+		health->ok = false;
+		health->clean = 0;
+		return false;
+	}
+
+	health->clean = min_t(unsigned int, health->clean + count, PICO_RNG_HEALTH_RECOVER);
+	if(!health->ok && health->clean == PICO_RNG_HEALTH_RECOVER)
+	{
+		LOGGER_WARN("health tests passing again, crediting the kernel\n");
+		health->ok = true;
+		// The batch that completed recovery is the last one held back
+		return false;
+	}
+
+	return health->ok;
+}
+
+/**
+ * Hand the device to the hwrng core as pico_rng<n>, after its minor.
+ * The char device works without it, so a failure isn't fatal.
+ **/
+static void pico_rng_hwrng_register(struct pico_rng_data *rng)
+{
+	int retval;
+
+	snprintf(rng->hwrng_name, sizeof(rng->hwrng_name), "pico_rng%d", rng->interface->minor);
+	rng->hwrng.name = rng->hwrng_name;
+	rng->hwrng.read = pico_rng_hwrng_read;
+	rng->hwrng.quality = min_t(unsigned int, credit_bits, 8) * 1024 / 8;
+	if(!rng->hwrng.quality)
+	{
+		rng->hwrng.quality = 1;
+	}
+	pico_rng_health_init(&rng->health);
+
+	retval = hwrng_register(&rng->hwrng);
+	if(retval)
+	{
+		LOGGER_ERR("Failed to register with hwrng %d\n", retval);
+		return;
+	}
+
+	rng->hwrng_registered = true;
+}
+
+/**
+ * Take the device back from the hwrng core, waits for reads in progress
+ **/
+static void pico_rng_hwrng_unregister(struct pico_rng_data *rng)
+{
+	if(rng->hwrng_registered)
+	{
+		hwrng_unregister(&rng->hwrng);
+		rng->hwrng_registered = false;
+	}
+}
+
+/**
+ * Allocate the URBs of a data path with coherent transfer buffers and put them all in flight
+ **/
+static int pico_rng_path_start(struct pico_rng_path *data_path)
+{
+	int i;
+	int cpu;
+	struct urb *urb;
+	void *buffer;
+	unsigned long flags;
+
+	spin_lock_init(&data_path->lock);
+	mutex_init(&data_path->read_lock);
+	init_waitqueue_head(&data_path->wait);
+	INIT_WORK(&data_path->clear_halt, pico_rng_path_clear_halt);
+	data_path->urb_size = PICO_RNG_URB_PACKETS * usb_endpoint_maxp(data_path->endpoint);
+	data_path->idle = 0;
+	data_path->running = false;
+	data_path->refilling = true;
+	data_path->stats.start = ktime_get();
+
+	if(kfifo_alloc(&data_path->fifo, max(buffer_size, data_path->urb_size), GFP_KERNEL))
+	{
+		LOGGER_ERR("Failed to allocate a %d byte buffer\n", buffer_size);
+		return -ENOMEM;
+	}
+
+	if(data_path->feeds_hwrng && kfifo_alloc(&data_path->pool, max(PICO_RNG_POOL_SIZE, data_path->urb_size), GFP_KERNEL))
+	{
+		LOGGER_ERR("Failed to allocate the pool buffer\n");
+		kfifo_free(&data_path->fifo);
+		return -ENOMEM;
+	}
+
+	data_path->percpu = alloc_percpu(struct pico_rng_percpu);
+	if(!data_path->percpu)
+	{
+		LOGGER_ERR("Failed to allocate the per-CPU caches\n");
+		kfifo_free(&data_path->pool);
+		kfifo_free(&data_path->fifo);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu)
+	{
+		mutex_init(&per_cpu_ptr(data_path->percpu, cpu)->lock);
+	}
+
+	// At least one URB has to fit under the high watermark, and the low one has to sit below that
+	data_path->high_watermark = clamp_t(unsigned int, high_watermark, data_path->urb_size, kfifo_size(&data_path->fifo));
+	data_path->low_watermark = clamp_t(unsigned int, low_watermark, 0, data_path->high_watermark - data_path->urb_size);
+	LOGGER_DEBUG("buffer %u bytes, watermarks %u-%u\n", kfifo_size(&data_path->fifo), data_path->low_watermark, data_path->high_watermark);
+
+	for(i = 0; i < PICO_RNG_NUM_URBS; i++)
+	{
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if(!urb)
+		{
+			goto error;
+		}
+
+		buffer = usb_alloc_coherent(data_path->rng->dev, data_path->urb_size, GFP_KERNEL, &urb->transfer_dma);
+		if(!buffer)
+		{
+			usb_free_urb(urb);
+			goto error;
+		}
+
+		usb_fill_bulk_urb(urb, data_path->rng->dev, data_path->pipe, buffer, data_path->urb_size,
+		                  pico_rng_urb_complete, data_path);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+		data_path->urbs[i] = urb;
+		__set_bit(i, &data_path->idle);
+	}
+
+	spin_lock_irqsave(&data_path->lock, flags);
+	data_path->running = true;
+	pico_rng_path_submit(data_path);
+	spin_unlock_irqrestore(&data_path->lock, flags);
+
+	return 0;
+
+error:
+	LOGGER_ERR("Failed to allocate urb %d\n", i);
+	pico_rng_path_free(data_path);
+	return -ENOMEM;
+}
+
+/**
+ * Cancel the URBs of a data path and wake up anyone waiting on it.
+ * The URBs and the fifo stay around for readers still holding the device until pico_rng_delete().
+ **/
+static void pico_rng_path_stop(struct pico_rng_path *data_path)
+{
+	int i;
+	unsigned long flags;
+
+	// Nothing is submitted once running is clear, so the URBs stay dead once killed
+	spin_lock_irqsave(&data_path->lock, flags);
+	data_path->running = false;
+	spin_unlock_irqrestore(&data_path->lock, flags);
+
+	for(i = 0; i < PICO_RNG_NUM_URBS; i++)
+	{
+		if(data_path->urbs[i])
+		{
+			usb_kill_urb(data_path->urbs[i]);
+		}
+	}
+
+	// Only refills after clearing the halt, which running being clear turns into a no-op
+	cancel_work_sync(&data_path->clear_halt);
+
+	wake_up_interruptible_all(&data_path->wait);
+	wake_up_interruptible_all(&pico_rng_aggregate_wait);
+}
+
+/**
+ * Kill the URBs of a data path for a suspend. Nothing is submitted until pico_rng_path_resume(),
+ * a reader that needs data in the meantime resumes the device instead.
+ * Returns -EBUSY for an autosuspend while URBs are in flight.
+ **/
+static int pico_rng_path_suspend(struct pico_rng_path *data_path, bool autosuspend)
+{
+	int i;
+	unsigned long flags;
+
+	spin_lock_irqsave(&data_path->lock, flags);
+	if(autosuspend && hweight_long(data_path->idle) != PICO_RNG_NUM_URBS)
+	{
+		spin_unlock_irqrestore(&data_path->lock, flags);
+		return -EBUSY;
+	}
+	data_path->suspended = true;
+	spin_unlock_irqrestore(&data_path->lock, flags);
+
+	for(i = 0; i < PICO_RNG_NUM_URBS; i++)
+	{
+		usb_kill_urb(data_path->urbs[i]);
+	}
+
+	// Killed URBs don't park themselves
+	spin_lock_irqsave(&data_path->lock, flags);
+	data_path->idle = GENMASK(PICO_RNG_NUM_URBS - 1, 0);
+	spin_unlock_irqrestore(&data_path->lock, flags);
+
+	return 0;
+}
+
+/**
+ * Let a suspended data path submit again and top up its buffers
+ **/
+static void pico_rng_path_resume(struct pico_rng_path *data_path)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&data_path->lock, flags);
+	data_path->suspended = false;
+	pico_rng_path_submit(data_path);
+	spin_unlock_irqrestore(&data_path->lock, flags);
+}
+
+/**
+ * Clear the halt of a stalled endpoint, which can only be done from process context, then put its URBs back in flight.
+ * If it fails the next read retries, so a device that keeps failing doesn't keep the work spinning.
+ **/
+static void pico_rng_path_clear_halt(struct work_struct *work)
+{
+	int retval;
+	unsigned long flags;
+	struct pico_rng_path *data_path = container_of(work, struct pico_rng_path, clear_halt);
+
+	retval = usb_clear_halt(data_path->rng->dev, data_path->pipe);
+	if(retval)
+	{
+		LOGGER_WARN("Failed to clear the halt of path %d %d\n", pico_rng_path_id(data_path), retval);
+	}
+
+	spin_lock_irqsave(&data_path->lock, flags);
+	data_path->halted = false;
+	if(!retval)
+	{
+		pico_rng_path_submit(data_path);
+	}
+	spin_unlock_irqrestore(&data_path->lock, flags);
+}
+
+/**
+ * Release the URBs of a data path and their transfer buffers
+ **/
+static void pico_rng_path_free(struct pico_rng_path *data_path)
+{
+	int i;
+	struct urb *urb;
+
+	for(i = 0; i < PICO_RNG_NUM_URBS; i++)
+	{
+		urb = data_path->urbs[i];
+		if(!urb)
+		{
+			continue;
+		}
+
+		usb_free_coherent(data_path->rng->dev, data_path->urb_size, urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+		data_path->urbs[i] = NULL;
+	}
+
+	data_path->idle = 0;
+	kfifo_free(&data_path->fifo);
+	kfifo_free(&data_path->pool);
+
+	if(data_path->percpu)
+	{
+		free_percpu(data_path->percpu);
+		data_path->percpu = NULL;
+	}
+}
+
+/**
+ * Put parked URBs back in flight until everything in flight would fill the fifo to the high watermark.
+ * Once it gets there nothing is submitted until readers drain it to the low watermark.
+ * While the shared ring is mapped it is filled to the brim instead, its consumer polls once it catches up.
+ * Either way one URB stays in flight while the pool is hungry, so the hwrng core never waits on readers.
+ * A suspended device is resumed instead, pico_rng_usb_resume() submits once it is back.
+ * A halted endpoint gets nothing until pico_rng_path_clear_halt() cleared it.
+ * Called with the path lock held.
+ **/
+static void pico_rng_path_submit(struct pico_rng_path *data_path)
+{
+	int i;
+	int retval;
+	u64 used;
+	u64 limit;
+	unsigned int in_flight = PICO_RNG_NUM_URBS - hweight_long(data_path->idle);
+
+	if(!data_path->running || data_path->halted)
+	{
+		return;
+	}
+
+	if(data_path->ring)
+	{
+		used = pico_rng_ring_used(data_path->ring);
+		limit = data_path->ring->size + pico_rng_fifo_deficit(data_path);
+	}
+	else
+	{
+		if(!data_path->refilling && kfifo_len(&data_path->fifo) <= data_path->low_watermark)
+		{
+			data_path->refilling = true;
+			trace_pico_rng_refill(data_path->rng->interface->minor, pico_rng_path_id(data_path),
+			                      kfifo_len(&data_path->fifo), in_flight);
+		}
+
+		if(!data_path->refilling && !pico_rng_pool_hungry(data_path))
+		{
+			return;
+		}
+
+		used = kfifo_len(&data_path->fifo);
+		limit = data_path->refilling ? data_path->high_watermark : 0;
+	}
+
+	for_each_set_bit(i, &data_path->idle, PICO_RNG_NUM_URBS)
+	{
+		if(used + (in_flight + 1) * data_path->urb_size > limit && (in_flight || !pico_rng_pool_hungry(data_path)))
+		{
+			data_path->refilling = !!data_path->ring;
+			break;
+		}
+
+		if(data_path->suspended)
+		{
+			// Queue a resume, the usage count drops right away so it autosuspends again once idle
+			if(!usb_autopm_get_interface_async(data_path->rng->interface))
+			{
+				usb_autopm_put_interface_async(data_path->rng->interface);
+			}
+			break;
+		}
+
+		data_path->submitted[i] = ktime_get();
+		retval = usb_submit_urb(data_path->urbs[i], GFP_ATOMIC);
+		if(retval)
+		{
+			LOGGER_ERR("Failed to submit urb %d %d\n", i, retval);
+			break;
+		}
+
+		trace_pico_rng_urb_submit(data_path->rng->interface->minor, pico_rng_path_id(data_path), i, data_path->urb_size);
+
+		__clear_bit(i, &data_path->idle);
+		in_flight++;
+	}
+}
+
+/**
+ * URB completion, runs in interrupt context.
+ * Moves the data into the pool and the fifo, then resubmits the URB if there is room for it or parks it until a reader drains the fifo.
+ **/
+static void pico_rng_urb_complete(struct urb *urb)
+{
+	int i;
+	unsigned long flags;
+	ktime_t elapsed = 0;
+	struct pico_rng_path *data_path = urb->context;
+
+	switch(urb->status)
+	{
+		case 0:
+			break;
+		case -ENOENT:
+		case -ECONNRESET:
+		case -ESHUTDOWN:
+			// Killed or unplugged
+			return;
+		case -EPIPE:
+			// Stalled, pico_rng_path_clear_halt() puts it back in flight once the halt is cleared
+			LOGGER_DEBUG("urb stalled\n");
+			break;
+		default:
+			// Park it, the next read retries. Keeps a misbehaving device from spinning the completion.
+			LOGGER_DEBUG("urb failed %d\n", urb->status);
+			break;
+	}
+
+	spin_lock_irqsave(&data_path->lock, flags);
+
+	for(i = 0; i < PICO_RNG_NUM_URBS; i++)
+	{
+		if(data_path->urbs[i] == urb)
+		{
+			elapsed = ktime_sub(ktime_get(), data_path->submitted[i]);
+			__set_bit(i, &data_path->idle);
+			break;
+		}
+	}
+
+	trace_pico_rng_urb_complete(data_path->rng->interface->minor, pico_rng_path_id(data_path), i, urb->status,
+	                            urb->actual_length, ktime_to_ns(elapsed));
+
+	if(!urb->status)
+	{
+		pico_rng_path_fan_out(data_path, urb->transfer_buffer, urb->actual_length);
+		usb_mark_last_busy(data_path->rng->dev);
+
+		atomic64_inc(&data_path->stats.urbs);
+		atomic64_add(urb->actual_length, &data_path->stats.urb_bytes);
+		pico_rng_hist_add(data_path->stats.urb_hist, elapsed);
+
+		pico_rng_path_submit(data_path);
+	}
+
+	if(urb->status == -EPIPE && !data_path->halted && data_path->running)
+	{
+		data_path->halted = true;
+		schedule_work(&data_path->clear_halt);
+	}
+
+	spin_unlock_irqrestore(&data_path->lock, flags);
+
+	if(!urb->status && urb->actual_length)
+	{
+		wake_up_interruptible(&data_path->wait);
+		wake_up_interruptible(&pico_rng_aggregate_wait);
+	}
+}
+
+/**
+ * Split a completed transfer between the kernel pool and the readers, the single producer of both.
+ * The pool takes pool_share percent of it, or whatever the readers' buffer has no room for if that is more.
+ * Called with the path lock held.
+ **/
+static void pico_rng_path_fan_out(struct pico_rng_path *data_path, const u8 *buffer, unsigned int count)
+{
+	u64 room;
+	unsigned int to_pool = 0;
+	unsigned int to_fifo;
+
+	if(data_path->feeds_hwrng)
+	{
+		room = data_path->ring ? data_path->ring->size - pico_rng_ring_used(data_path->ring) + pico_rng_fifo_deficit(data_path)
+		                       : kfifo_avail(&data_path->fifo);
+		to_pool = count * clamp(READ_ONCE(pool_share), 0, 100) / 100;
+		to_pool = max_t(u64, to_pool, count - min_t(u64, count, room));
+		to_pool = kfifo_in(&data_path->pool, buffer, to_pool);
+	}
+
+	if(data_path->ring)
+	{
+		// Readers, the aggregate device and DRBG seeding keep getting served while the ring is mapped
+		to_fifo = min(count - to_pool, pico_rng_fifo_deficit(data_path));
+		kfifo_in(&data_path->fifo, buffer + to_pool, to_fifo);
+		pico_rng_ring_in(data_path->ring, buffer + to_pool + to_fifo, count - to_pool - to_fifo);
+	}
+	else
+	{
+		kfifo_in(&data_path->fifo, buffer + to_pool, count - to_pool);
+	}
+}
+
+/**
+ * Bytes the fifo of a data path is short of its low watermark, what it is topped up to while the ring is mapped.
+ * Called with the path lock held.
+ **/
+static unsigned int pico_rng_fifo_deficit(struct pico_rng_path *data_path)
+{
+	unsigned int len = kfifo_len(&data_path->fifo);
+
+	return len < data_path->low_watermark ? data_path->low_watermark - len : 0;
+}
+
+/**
+ * Whether the pool of a data path wants more data than the readers are asking for. Called with the path lock held.
+ **/
+static bool pico_rng_pool_hungry(struct pico_rng_path *data_path)
+{
+	return data_path->feeds_hwrng && kfifo_len(&data_path->pool) < kfifo_size(&data_path->pool) / 2;
+}
+
+/**
+ * Put parked URBs back in flight once a reader made room
+ **/
+static void pico_rng_path_refill(struct pico_rng_path *data_path)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&data_path->lock, flags);
+	pico_rng_path_submit(data_path);
+	spin_unlock_irqrestore(&data_path->lock, flags);
+}
+
+/**
+ * Wait up to timeout milliseconds for the URB pipeline of a data path to deliver.
+ * Returns 0 once there is data to read, or a negative error. With nonblock it doesn't wait
+ * and returns -EAGAIN when the buffer is empty.
+ **/
+static int pico_rng_wait_data(struct pico_rng_path *data_path, bool nonblock)
+{
+	long retval;
+
+	// Retry whatever a failed completion parked
+	pico_rng_path_refill(data_path);
+
+	if(nonblock)
+	{
+		if(!data_path->running)
+		{
+			return -ENODEV;
+		}
+
+		return kfifo_is_empty(&data_path->fifo) ? -EAGAIN : 0;
+	}
+
+	retval = wait_event_interruptible_timeout(data_path->wait,
+	                                          !kfifo_is_empty(&data_path->fifo) || !data_path->running,
+	                                          msecs_to_jiffies(timeout));
+	if(retval < 0)
+	{
+		return retval;
+	}
+
+	if(!data_path->running)
+	{
+		return -ENODEV;
+	}
+
+	if(!retval)
+	{
+		return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+/**
+ * Read data from one of the pico rng data paths into a kernel buffer.
+ * Waits up to timeout milliseconds for the URB pipeline to deliver, then fills the buffer
+ * and returns the number of bytes filled, or a negative error.
+ * Count is the maximum number of bytes the buffer can hold.
+ */
+static int pico_rng_read_data(struct pico_rng_path *data_path, void *buffer, int count)
+{
+	int retval;
+	unsigned int copied;
+
+	LOGGER_DEBUG("Reading path %p, buffer %p, size %d, and timeout %d\n", data_path, buffer, count, timeout);
+
+	retval = pico_rng_wait_data(data_path, false);
+	if(retval)
+	{
+		return retval;
+	}
+
+	// The completion is the only writer, so readers only need to keep out of each other's way
+	mutex_lock(&data_path->read_lock);
+	copied = kfifo_out(&data_path->fifo, (u8 *)buffer, count);
+	mutex_unlock(&data_path->read_lock);
+
+	pico_rng_path_refill(data_path);
+
+	return copied;
+}
+
+/**
+ * Read the pool share of a data path into a kernel buffer, for the hwrng core.
+ * Waits up to timeout milliseconds for it when wait is set, otherwise returns 0 if it is empty.
+ * Returns the number of bytes filled or a negative error.
+ **/
+static int pico_rng_read_pool(struct pico_rng_path *data_path, void *buffer, int count, bool wait)
+{
+	long retval;
+	unsigned int copied;
+
+	pico_rng_path_refill(data_path);
+
+	if(!wait && kfifo_is_empty(&data_path->pool))
+	{
+		return 0;
+	}
+
+	retval = wait_event_interruptible_timeout(data_path->wait,
+	                                          !kfifo_is_empty(&data_path->pool) || !data_path->running,
+	                                          msecs_to_jiffies(timeout));
+	if(retval < 0)
+	{
+		return retval;
+	}
+
+	if(!data_path->running)
+	{
+		return -ENODEV;
+	}
+
+	if(!retval)
+	{
+		return -ETIMEDOUT;
+	}
+
+	// The hwrng core serialises its reads, so the completion and this are the only two ends of the pool
+	copied = kfifo_out(&data_path->pool, (u8 *)buffer, count);
+
+	pico_rng_path_refill(data_path);
+
+	return copied;
+}
+
+/**
+ * Copy one stretch of the prefetch buffer of a data path straight to userspace, waiting for it
+ * unless nonblock. Returns the number of bytes copied or a negative error.
+ **/
+static ssize_t pico_rng_read_fifo(struct pico_rng_path *data_path, struct iov_iter *to, size_t count, bool nonblock)
+{
+	int i;
+	int nents;
+	int retval;
+	size_t copied = 0;
+	size_t chunk;
+	struct scatterlist sg[2];
+
+	retval = pico_rng_wait_data(data_path, nonblock);
+	if(retval)
+	{
+		return retval;
+	}
+
+	retval = mutex_lock_interruptible(&data_path->read_lock);
+	if(retval)
+	{
+		return retval;
+	}
+	// The fifo memory itself, in at most two pieces where it wraps, copied straight into the iterator
+	sg_init_table(sg, ARRAY_SIZE(sg));
+	nents = kfifo_dma_out_prepare(&data_path->fifo, sg, ARRAY_SIZE(sg), min_t(size_t, count, UINT_MAX));
+	for(i = 0; i < nents; i++)
+	{
+		chunk = copy_to_iter(sg_virt(&sg[i]), sg[i].length, to);
+		copied += chunk;
+		if(chunk < sg[i].length)
+		{
+			break;
+		}
+	}
+	kfifo_dma_out_finish(&data_path->fifo, copied);
+	mutex_unlock(&data_path->read_lock);
+
+	pico_rng_path_refill(data_path);
+
+	if(!copied && count)
+	{
+		return -EFAULT;
+	}
+
+	return copied;
+}
+
+/**
+ * Take the lock of a per-CPU cache. With nonblock a cache in use by another reader is -EAGAIN rather than a wait.
+ **/
+static int pico_rng_percpu_lock(struct pico_rng_percpu *cache, bool nonblock)
+{
+	if(nonblock)
+	{
+		return mutex_trylock(&cache->lock) ? 0 : -EAGAIN;
+	}
+
+	return mutex_lock_interruptible(&cache->lock);
+}
+
+/**
+ * Copy from the cache of the CPU the reader runs on, refilling it with a batch from the prefetch buffer
+ * once it runs out. Readers on different CPUs only meet on the fifo once per batch.
+ * Returns the number of bytes copied or a negative error.
+ **/
+static ssize_t pico_rng_read_percpu(struct pico_rng_path *data_path, struct iov_iter *to, size_t count, bool nonblock)
+{
+	int retval;
+	struct pico_rng_percpu *cache = per_cpu_ptr(data_path->percpu, raw_smp_processor_id());
+
+	// Migrating off the CPU afterwards is harmless, the cache lock is what keeps readers apart
+	retval = pico_rng_percpu_lock(cache, nonblock);
+	if(retval)
+	{
+		return retval;
+	}
+
+	while(cache->pos == cache->len)
+	{
+		// The wait can take up to timeout msecs, the other readers on this CPU don't sit it out with us
+		mutex_unlock(&cache->lock);
+
+		retval = pico_rng_wait_data(data_path, nonblock);
+		if(!retval)
+		{
+			retval = pico_rng_percpu_lock(cache, nonblock);
+		}
+		if(retval)
+		{
+			return retval;
+		}
+
+		// Another reader may have refilled it in the meantime
+		if(cache->pos == cache->len)
+		{
+			mutex_lock(&data_path->read_lock);
+			cache->len = kfifo_out(&data_path->fifo, cache->buffer, sizeof(cache->buffer));
+			mutex_unlock(&data_path->read_lock);
+			cache->pos = 0;
+
+			pico_rng_path_refill(data_path);
+		}
+	}
+
+	count = copy_to_iter(cache->buffer + cache->pos, min_t(size_t, count, cache->len - cache->pos), to);
+	if(!count)
+	{
+		retval = -EFAULT;
+		goto out;
+	}
+
+	// Bytes handed out don't linger in the cache
+	memzero_explicit(cache->buffer + cache->pos, count);
+	cache->pos += count;
+	retval = count;
+
+out:
+	mutex_unlock(&cache->lock);
+	return retval;
+}
+
+/**
+ * Read data from one of the pico rng data paths to userspace. Small reads come out of the
+ * per-CPU caches so concurrent readers scale across cores, larger ones straight from the prefetch buffer.
+ * Keeps going while the device keeps delivering, so count bytes are returned unless it stops
+ * for timeout milliseconds or a signal arrives, or the buffer runs dry with nonblock.
+ * Then whatever was copied so far is returned, or a negative error if nothing was.
+ **/
+static ssize_t pico_rng_read_user(struct pico_rng_path *data_path, struct iov_iter *to, size_t count, bool nonblock)
+{
+	ssize_t retval = 0;
+	size_t total = 0;
+	ktime_t start = ktime_get();
+	ktime_t elapsed;
+
+	LOGGER_DEBUG("Reading path %p, iterator %p, size %zu, and timeout %d\n", data_path, to, count, timeout);
+
+	while(total < count)
+	{
+		if(count < PICO_RNG_PERCPU_SIZE && READ_ONCE(percpu_cache))
+		{
+			retval = pico_rng_read_percpu(data_path, to, count - total, nonblock);
+		}
+		else
+		{
+			retval = pico_rng_read_fifo(data_path, to, count - total, nonblock);
+		}
+
+		if(retval < 0)
+		{
+			break;
+		}
+		total += retval;
+	}
+
+	elapsed = ktime_sub(ktime_get(), start);
+	trace_pico_rng_read(data_path->rng->interface->minor, pico_rng_path_id(data_path), count,
+	                    total ? total : retval, ktime_to_ns(elapsed));
+
+	atomic64_inc(&data_path->stats.reads);
+	atomic64_add(total, &data_path->stats.read_bytes);
+	pico_rng_hist_add(data_path->stats.read_hist, elapsed);
+
+	return total ? total : retval;
+}
+
+/**
+ * The number of a data path on its device, what the path parameter picks
+ **/
+static int pico_rng_path_id(struct pico_rng_path *data_path)
+{
+	return data_path - data_path->rng->paths;
+}
+
+/**
+ * Count a latency in its log2 usec bucket of a histogram
+ **/
+static void pico_rng_hist_add(atomic_t *hist, ktime_t elapsed)
+{
+	unsigned int bucket = fls64(ktime_to_us(elapsed));
+
+	atomic_inc(&hist[min_t(unsigned int, bucket, PICO_RNG_HIST_BUCKETS - 1)]);
+}
+
+/**
+ * Give a device a pico_rng<n> directory in debugfs, after its minor, with its stats file.
+ * Nothing depends on debugfs, so a failure isn't fatal.
+ **/
+static void pico_rng_debugfs_add(struct pico_rng_data *rng)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "pico_rng%d", rng->interface->minor);
+	rng->debugfs = debugfs_create_dir(name, pico_rng_debugfs);
+	debugfs_create_file("stats", S_IRUSR, rng->debugfs, rng, &pico_rng_stats_fops);
+}
+
+/**
+ * debugfs: stats
+ * Prints the throughput counters and latency histograms of every data path of a device
+ **/
+static int pico_rng_stats_show(struct seq_file *s, void *unused)
+{
+	int i;
+	int bucket;
+	s64 elapsed_ms;
+	struct pico_rng_data *rng = s->private;
+	struct pico_rng_path *data_path;
+
+	for(i = 0; i < PICO_RNG_NUM_PATHS; i++)
+	{
+		data_path = &rng->paths[i];
+		if(!data_path->endpoint)
+		{
+			continue;
+		}
+
+		elapsed_ms = max_t(s64, ktime_ms_delta(ktime_get(), data_path->stats.start), 1);
+
+		seq_printf(s, "path %d\n", i);
+		seq_printf(s, "  urbs %lld, %lld bytes, %lld KB/s\n", atomic64_read(&data_path->stats.urbs),
+		           atomic64_read(&data_path->stats.urb_bytes), atomic64_read(&data_path->stats.urb_bytes) / elapsed_ms);
+		seq_printf(s, "  reads %lld, %lld bytes, %lld KB/s\n", atomic64_read(&data_path->stats.reads),
+		           atomic64_read(&data_path->stats.read_bytes), atomic64_read(&data_path->stats.read_bytes) / elapsed_ms);
+		seq_printf(s, "  %-16s %12s %12s\n", "usecs", "usb rtt", "read");
+
+		for(bucket = 0; bucket < PICO_RNG_HIST_BUCKETS; bucket++)
+		{
+			seq_printf(s, "  < %-14lu %12d %12d\n", 1UL << bucket,
+			           atomic_read(&data_path->stats.urb_hist[bucket]), atomic_read(&data_path->stats.read_hist[bucket]));
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Module:init
  **/
 static int __init pico_rng_driver_init(void)
 {
 	int retval = 0;
    	LOGGER_INFO("pico rng driver debut\n");
+
+	pico_rng_debugfs = debugfs_create_dir("pico_rng", NULL);
 	
 	retval = usb_register(&pico_rng_usb_driver);
 	if(retval)
 	{
 		LOGGER_ERR("registering pico rng driver failed\n");
+		debugfs_remove_recursive(pico_rng_debugfs);
 		return retval;
 	}
 	else
@@ -340,6 +2460,18 @@ static int __init pico_rng_driver_init(void)
 		LOGGER_INFO("pico rng driver registered successfully\n");
 	}
 
+	if(aggregate)
+	{
+		retval = misc_register(&pico_rng_aggregate_dev);
+		if(retval)
+		{
+			LOGGER_ERR("registering the aggregate device failed\n");
+			usb_deregister(&pico_rng_usb_driver);
+			debugfs_remove_recursive(pico_rng_debugfs);
+			return retval;
+		}
+	}
+
 	return 0;
 }
 
@@ -348,6 +2480,11 @@ static int __init pico_rng_driver_init(void)
  **/
 static void __exit pico_rng_driver_exit(void)
 {
+	if(aggregate)
+	{
+		misc_deregister(&pico_rng_aggregate_dev);
+	}
 	usb_deregister(&pico_rng_usb_driver);
+	debugfs_remove_recursive(pico_rng_debugfs);
 	return;
 }
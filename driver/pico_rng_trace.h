@@ -0,0 +1,118 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/**
+ * Tracepoints of the data path, see /sys/kernel/tracing/events/pico_rng.
+ * Every event carries the minor of the device and the data path it happened on.
+ **/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pico_rng
+
+#if !defined(PICO_RNG_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define PICO_RNG_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/**
+ * A URB of a data path goes in flight
+ **/
+TRACE_EVENT(pico_rng_urb_submit,
+	TP_PROTO(int minor, int path, int urb, int length),
+	TP_ARGS(minor, path, urb, length),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, path)
+		__field(int, urb)
+		__field(int, length)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->path = path;
+		__entry->urb = urb;
+		__entry->length = length;
+	),
+	TP_printk("minor=%d path=%d urb=%d length=%d", __entry->minor, __entry->path, __entry->urb, __entry->length)
+);
+
+/**
+ * A URB of a data path completed, rtt_ns after it was submitted
+ **/
+TRACE_EVENT(pico_rng_urb_complete,
+	TP_PROTO(int minor, int path, int urb, int status, int actual_length, u64 rtt_ns),
+	TP_ARGS(minor, path, urb, status, actual_length, rtt_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, path)
+		__field(int, urb)
+		__field(int, status)
+		__field(int, actual_length)
+		__field(u64, rtt_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->path = path;
+		__entry->urb = urb;
+		__entry->status = status;
+		__entry->actual_length = actual_length;
+		__entry->rtt_ns = rtt_ns;
+	),
+	TP_printk("minor=%d path=%d urb=%d status=%d actual_length=%d rtt_ns=%llu", __entry->minor, __entry->path,
+	          __entry->urb, __entry->status, __entry->actual_length, __entry->rtt_ns)
+);
+
+/**
+ * The prefetch buffer of a data path dropped to its low watermark and transfers start again
+ **/
+TRACE_EVENT(pico_rng_refill,
+	TP_PROTO(int minor, int path, unsigned int used, unsigned int in_flight),
+	TP_ARGS(minor, path, used, in_flight),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, path)
+		__field(unsigned int, used)
+		__field(unsigned int, in_flight)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->path = path;
+		__entry->used = used;
+		__entry->in_flight = in_flight;
+	),
+	TP_printk("minor=%d path=%d used=%u in_flight=%u", __entry->minor, __entry->path, __entry->used, __entry->in_flight)
+);
+
+/**
+ * A read of a character device was served from a data path in service_ns
+ **/
+TRACE_EVENT(pico_rng_read,
+	TP_PROTO(int minor, int path, size_t count, ssize_t retval, u64 service_ns),
+	TP_ARGS(minor, path, count, retval, service_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, path)
+		__field(size_t, count)
+		__field(ssize_t, retval)
+		__field(u64, service_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->path = path;
+		__entry->count = count;
+		__entry->retval = retval;
+		__entry->service_ns = service_ns;
+	),
+	TP_printk("minor=%d path=%d count=%zu retval=%zd service_ns=%llu", __entry->minor, __entry->path,
+	          __entry->count, __entry->retval, __entry->service_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pico_rng_trace
+
+#include <trace/define_trace.h>
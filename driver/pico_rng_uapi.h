@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef PICO_RNG_UAPI_H_
+#define PICO_RNG_UAPI_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/**
+ * Shared ring layout of an mmap of /dev/pico_rng<n>
+ * The mapping is one header page followed by size bytes of ring data, so its length
+ * has to be data_offset + size, with size read from /sys/module/pico_rng/parameters/mmap_size.
+ * The driver only ever advances head and userspace only ever advances tail. Both count bytes
+ * and never wrap, the data of byte i lives at data_offset + (i & (size - 1)).
+ * The driver keeps its own copy of head, so writing to it has no effect.
+ **/
+#define PICO_RNG_RING_VERSION 1
+
+struct pico_rng_ring_header {
+	__u32 version;      // PICO_RNG_RING_VERSION
+	__u32 data_offset;  // offset of the ring data from the start of the mapping, one page
+	__u64 size;         // bytes of ring data, a power of 2
+	__u64 head;         // bytes written by the driver, read with acquire semantics
+	__u64 tail;         // bytes consumed, written by userspace with release semantics
+};
+
+/**
+ * What reads of an open /dev/pico_rng or /dev/pico_rng<n> return, set per file with PICO_RNG_IOC_SET_READ_MODE
+ **/
+enum pico_rng_read_mode {
+	PICO_RNG_READ_DEVICE = 0,   // bytes straight from the Pico, the default
+	PICO_RNG_READ_DRBG,         // output of a kernel crypto API DRBG seeded and reseeded from the Pico
+};
+
+#define PICO_RNG_IOC_MAGIC            'P'
+#define PICO_RNG_IOC_SET_READ_MODE    _IOW(PICO_RNG_IOC_MAGIC, 1, __u32)
+#define PICO_RNG_IOC_GET_READ_MODE    _IOR(PICO_RNG_IOC_MAGIC, 2, __u32)
+
+#endif
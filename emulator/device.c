@@ -0,0 +1,212 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "device.h"
+
+#include <string.h>
+#include <stdatomic.h>
+
+// The firmware's descriptors and vendor requests, so the emulator can't drift from them
+#include "pico_rng.h"
+#include "harvester.h"
+#include "log.h"
+
+// The bulk IN endpoints in config descriptor order
+static const struct usb_endpoint_descriptor *streams[DEVICE_NUM_STREAMS] = { &ep1_in, &ep2_in, &ep3_in };
+
+// Counters for PICO_RNG_REQUEST_GET_STATS, bumped by the endpoint threads
+static atomic_uint_fast64_t bytes_sent;
+static atomic_uint_fast32_t packets_sent;
+
+// Stream selected for EP1 with PICO_RNG_REQUEST_SET_MODE. Every stream is the same random data here.
+static uint16_t mode = HARVESTER_DEFAULT_MODE;
+
+/**
+ * @brief Copy as much of a descriptor as the host asked for.
+ *
+ * @return the number of bytes copied
+ */
+static int device_reply(uint8_t *buf, size_t len, const struct device_setup *setup, const void *data, size_t size) {
+    if (size > setup->wLength) {
+        size = setup->wLength;
+    }
+    if (size > len) {
+        size = len;
+    }
+
+    memcpy(buf, data, size);
+    return (int) size;
+}
+
+/**
+ * @brief The configuration descriptor followed by the interface and endpoint descriptors, as the firmware sends it.
+ *
+ * @return the number of bytes stored in buf
+ */
+static size_t device_config_descriptor(uint8_t *buf) {
+    uint8_t *p = buf;
+
+    memcpy(p, &config_descriptor, sizeof(config_descriptor));
+    p += sizeof(config_descriptor);
+    memcpy(p, &interface_descriptor, sizeof(interface_descriptor));
+    p += sizeof(interface_descriptor);
+
+    for (int i = 0; i < DEVICE_NUM_STREAMS; i++) {
+        memcpy(p, streams[i], sizeof(struct usb_endpoint_descriptor));
+        p += sizeof(struct usb_endpoint_descriptor);
+    }
+
+    return p - buf;
+}
+
+/**
+ * @brief A string descriptor, the ASCII string widened to UTF-16LE like usb_prepare_string_descriptor().
+ *
+ * @return the number of bytes stored in buf, 0 if there is no such string
+ */
+static size_t device_string_descriptor(uint8_t index, uint8_t *buf) {
+    if (index == 0) {
+        memcpy(buf, lang_descriptor, sizeof(lang_descriptor));
+        return sizeof(lang_descriptor);
+    }
+
+    if (index > count_of(descriptor_strings)) {
+        return 0;
+    }
+
+    const unsigned char *str = descriptor_strings[index - 1];
+    size_t len = strlen((const char *) str);
+
+    buf[0] = 2 + len * 2;
+    buf[1] = USB_DT_STRING;
+    for (size_t i = 0; i < len; i++) {
+        buf[2 + i * 2] = str[i];
+        buf[3 + i * 2] = 0;
+    }
+
+    return buf[0];
+}
+
+/**
+ * @brief Fill in the counters block of PICO_RNG_REQUEST_GET_STATS. The emulator has no ADC, rings or
+ * IRQs, so those read 0, and its data always passes the health tests.
+ */
+static void device_stats(struct pico_rng_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->version = PICO_RNG_STATS_VERSION;
+    stats->length = sizeof(struct pico_rng_stats);
+    stats->bytes_produced = atomic_load(&bytes_sent);
+    stats->packets_sent = atomic_load(&packets_sent);
+    stats->health_status = PICO_RNG_HEALTH_OK;
+}
+
+/**
+ * @brief Vendor requests, see usb_handle_vendor_request() in the firmware.
+ */
+static int device_vendor_request(const struct device_setup *setup, uint8_t *buf, size_t len) {
+    struct pico_rng_stats stats;
+
+    switch (setup->bRequest) {
+        case PICO_RNG_REQUEST_SET_MODE:
+            if (setup->wValue >= HARVESTER_NUM_STREAMS) {
+                LOGGER_WARN("Unknown mode %d\n", setup->wValue);
+                return -1;
+            }
+            mode = setup->wValue;
+            LOGGER_INFO("SET MODE %d\n", mode);
+            return 0;
+
+        case PICO_RNG_REQUEST_SET_RESEED_INTERVAL:
+            LOGGER_INFO("SET RESEED INTERVAL %d KiB\n", setup->wValue);
+            return 0;
+
+        case PICO_RNG_REQUEST_DUMP_TRACE:
+            LOGGER_INFO("DUMP TRACE, the emulator has no trace rings\n");
+            return 0;
+
+        case PICO_RNG_REQUEST_GET_STATS:
+            device_stats(&stats);
+            return device_reply(buf, len, setup, &stats, sizeof(stats));
+
+        case PICO_RNG_REQUEST_RESET_STATS:
+            atomic_store(&bytes_sent, 0);
+            atomic_store(&packets_sent, 0);
+            return 0;
+
+        default:
+            LOGGER_WARN("Unhandled vendor request 0x%x\n", setup->bRequest);
+            return -1;
+    }
+}
+
+int device_control(const struct device_setup *setup, uint8_t *buf, size_t len) {
+    uint8_t descriptor[256];
+    size_t size;
+
+    if ((setup->bmRequestType & USB_REQ_TYPE_TYPE_MASK) == USB_REQ_TYPE_TYPE_VENDOR) {
+        return device_vendor_request(setup, buf, len);
+    }
+
+    if ((setup->bmRequestType & USB_REQ_TYPE_TYPE_MASK) != USB_REQ_TYPE_STANDARD) {
+        return -1;
+    }
+
+    switch (setup->bRequest) {
+        case USB_REQUEST_GET_DESCRIPTOR:
+            switch (setup->wValue >> 8) {
+                case USB_DT_DEVICE:
+                    return device_reply(buf, len, setup, &device_descriptor, sizeof(device_descriptor));
+
+                case USB_DT_CONFIG:
+                    size = device_config_descriptor(descriptor);
+                    return device_reply(buf, len, setup, descriptor, size);
+
+                case USB_DT_STRING:
+                    size = device_string_descriptor(setup->wValue & 0xff, descriptor);
+                    return size ? device_reply(buf, len, setup, descriptor, size) : -1;
+
+                default:
+                    LOGGER_DEBUG("Unhandled descriptor type 0x%x\n", setup->wValue >> 8);
+                    return -1;
+            }
+
+        case USB_REQUEST_GET_CONFIGURATION:
+            descriptor[0] = config_descriptor.bConfigurationValue;
+            return device_reply(buf, len, setup, descriptor, 1);
+
+        case USB_REQUEST_GET_STATUS:
+            // Self powered, no remote wakeup, endpoints not halted
+            descriptor[0] = (setup->bmRequestType & USB_REQ_TYPE_RECIPIENT_MASK) == USB_REQ_TYPE_RECIPIENT_DEVICE ? 1 : 0;
+            descriptor[1] = 0;
+            return device_reply(buf, len, setup, descriptor, 2);
+
+        case USB_REQUEST_SET_INTERFACE:
+            return setup->wValue == 0 ? 0 : -1;
+
+        default:
+            LOGGER_DEBUG("Unhandled standard request 0x%x\n", setup->bRequest);
+            return -1;
+    }
+}
+
+int device_endpoints(uint8_t descs[DEVICE_NUM_STREAMS][DEVICE_EP_DESC_SIZE]) {
+    for (int i = 0; i < DEVICE_NUM_STREAMS; i++) {
+        memcpy(descs[i], streams[i], DEVICE_EP_DESC_SIZE);
+    }
+
+    return DEVICE_NUM_STREAMS;
+}
+
+uint8_t device_max_power(void) {
+    return config_descriptor.bMaxPower;
+}
+
+void device_count_transfer(int stream, size_t len) {
+    uint16_t maxp = streams[stream]->wMaxPacketSize;
+
+    atomic_fetch_add(&bytes_sent, len);
+    atomic_fetch_add(&packets_sent, len ? (len + maxp - 1) / maxp : 1);
+}
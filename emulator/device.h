@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef DEVICE_H_
+#define DEVICE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The Pico as the host sees it, built from the firmware's own descriptors and vendor requests.
+// Kept apart from pico_rng_emulator.c because the firmware's usb_common.h and <linux/usb/ch9.h>
+// define the same names, so only plain types cross this header.
+
+// Bulk IN endpoints, EP1-3
+#define DEVICE_NUM_STREAMS 3
+
+// Bytes in a USB endpoint descriptor
+#define DEVICE_EP_DESC_SIZE 7
+
+// A control request, host byte order
+struct device_setup {
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+};
+
+/**
+ * @brief Answer a control request the way the firmware does. SET_CONFIGURATION is left to the caller,
+ * which has to enable the endpoints first.
+ *
+ * @param setup the request
+ * @param buf the buffer to store IN data in
+ * @param len the size of buf
+ * @return the number of bytes of IN data, 0 for an OUT request that was handled, or -1 to stall
+ */
+int device_control(const struct device_setup *setup, uint8_t *buf, size_t len);
+
+/**
+ * @brief The descriptors of the bulk IN endpoints, in the order of the config descriptor.
+ *
+ * @param descs set to the raw endpoint descriptors
+ * @return the number of endpoints
+ */
+int device_endpoints(uint8_t descs[DEVICE_NUM_STREAMS][DEVICE_EP_DESC_SIZE]);
+
+/**
+ * @brief bMaxPower of the configuration, in 2 mA units.
+ *
+ * @return uint8_t
+ */
+uint8_t device_max_power(void);
+
+/**
+ * @brief Count a transfer sent on a bulk IN endpoint, for PICO_RNG_REQUEST_GET_STATS.
+ *
+ * @param stream the endpoint, 0 for EP1
+ * @param len the bytes sent
+ */
+void device_count_transfer(int stream, size_t len);
+
+#endif
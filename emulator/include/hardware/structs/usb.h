@@ -0,0 +1,14 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef EMULATOR_HARDWARE_STRUCTS_USB_H_
+#define EMULATOR_HARDWARE_STRUCTS_USB_H_
+
+// Host stand-in for the pico-sdk header, the RP2040 USB controller has 16 endpoints
+
+#define USB_NUM_ENDPOINTS 16
+
+#endif
@@ -0,0 +1,24 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef EMULATOR_PICO_TYPES_H_
+#define EMULATOR_PICO_TYPES_H_
+
+// Host stand-in for the pico-sdk header, just enough for the firmware's descriptor headers
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+#ifndef __packed
+#define __packed __attribute__((packed))
+#endif
+
+#endif
@@ -0,0 +1,499 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Emulated Pico RNG for testing the driver without the hardware. Presents the firmware's VID:PID,
+// descriptors and bulk IN endpoints to the local host through raw_gadget on a dummy_hcd UDC:
+//   sudo modprobe dummy_hcd && sudo modprobe raw_gadget
+//   sudo ./pico_rng_emulator [--rate <bytes/s>] [--stall-every <n>] ...
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "device.h"
+
+// Largest control transfer answered, the config descriptor bundle and the stats block are well under it
+#define EP0_MAX_DATA 256
+
+// Largest bulk transfer written at once
+#define EP_MAX_DATA 4096
+
+// Fill byte of a stuck transfer, and the byte a biased stream leans towards
+#define STUCK_BYTE 0xa5
+
+// raw_gadget events newer than the CONNECT and CONTROL every kernel has
+#define EVENT_RESET 5
+#define EVENT_DISCONNECT 6
+
+struct ep0_io {
+    struct usb_raw_ep_io inner;
+    uint8_t data[EP0_MAX_DATA];
+};
+
+struct ep_io {
+    struct usb_raw_ep_io inner;
+    uint8_t data[EP_MAX_DATA];
+};
+
+struct control_event {
+    struct usb_raw_event inner;
+    struct usb_ctrlrequest ctrl;
+};
+
+// Command line options, see usage()
+static struct {
+    const char *driver;
+    const char *device;
+    size_t transfer;       // bytes per bulk transfer
+    uint64_t rate;         // bytes/s per endpoint, 0 for as fast as the host reads
+    unsigned int delay_ms; // added to every transfer
+    unsigned int short_every;
+    unsigned int stall_every;
+    unsigned int stall_ms;
+    unsigned int stuck_every;
+    unsigned int disconnect_after;
+    unsigned int bias;     // percent of bytes replaced with STUCK_BYTE
+    bool counter;          // counting bytes instead of random data
+    bool verbose;
+} options = {
+    .driver = "dummy_udc",
+    .device = "dummy_udc.0",
+    .transfer = 512,
+    .stall_ms = 100,
+};
+
+// A bulk IN endpoint and the thread streaming on it
+struct stream {
+    int index;
+    int handle;
+    uint8_t counter;
+    bool running;
+    pthread_t thread;
+};
+
+static int raw_fd;
+static struct stream streams[DEVICE_NUM_STREAMS];
+static int num_streams = 0;
+static bool configured = false;
+
+// Set while the endpoints are torn down, tells the stream threads to return
+static volatile sig_atomic_t stopping = 0;
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --driver <name>          UDC driver to attach to (default dummy_udc)\n"
+            "  --device <name>          UDC device to attach to (default dummy_udc.0)\n"
+            "  --transfer <bytes>       bytes per bulk transfer (default 512, at most %d)\n"
+            "  --rate <bytes/s>         data rate per endpoint (default as fast as the host reads)\n"
+            "  --delay-ms <ms>          latency added to every transfer\n"
+            "  --short-every <n>        make every nth transfer a short packet\n"
+            "  --stall-every <n>        halt the endpoint on every nth transfer\n"
+            "  --stall-ms <ms>          how long a halt lasts (default 100)\n"
+            "  --stuck-every <n>        make every nth transfer one repeated byte, trips the repetition count test\n"
+            "  --bias <percent>         replace that share of bytes with one value, 70 trips the adaptive proportion test\n"
+            "  --disconnect-after <s>   unplug after that many seconds\n"
+            "  --counter                send counting bytes instead of random data\n"
+            "  --verbose                log every control request\n",
+            name, EP_MAX_DATA);
+}
+
+static void parse_options(int argc, char **argv) {
+    static const struct option long_options[] = {
+            { "driver", required_argument, NULL, 'D' },
+            { "device", required_argument, NULL, 'd' },
+            { "transfer", required_argument, NULL, 't' },
+            { "rate", required_argument, NULL, 'r' },
+            { "delay-ms", required_argument, NULL, 'l' },
+            { "short-every", required_argument, NULL, 'S' },
+            { "stall-every", required_argument, NULL, 'h' },
+            { "stall-ms", required_argument, NULL, 'H' },
+            { "stuck-every", required_argument, NULL, 'k' },
+            { "disconnect-after", required_argument, NULL, 'x' },
+            { "bias", required_argument, NULL, 'b' },
+            { "counter", no_argument, NULL, 'c' },
+            { "verbose", no_argument, NULL, 'v' },
+            { "help", no_argument, NULL, '?' },
+            { NULL, 0, NULL, 0 }
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'D': options.driver = optarg; break;
+            case 'd': options.device = optarg; break;
+            case 't': options.transfer = strtoul(optarg, NULL, 0); break;
+            case 'r': options.rate = strtoull(optarg, NULL, 0); break;
+            case 'l': options.delay_ms = strtoul(optarg, NULL, 0); break;
+            case 'S': options.short_every = strtoul(optarg, NULL, 0); break;
+            case 'h': options.stall_every = strtoul(optarg, NULL, 0); break;
+            case 'H': options.stall_ms = strtoul(optarg, NULL, 0); break;
+            case 'k': options.stuck_every = strtoul(optarg, NULL, 0); break;
+            case 'x': options.disconnect_after = strtoul(optarg, NULL, 0); break;
+            case 'b': options.bias = strtoul(optarg, NULL, 0); break;
+            case 'c': options.counter = true; break;
+            case 'v': options.verbose = true; break;
+            default:
+                usage(argv[0]);
+                exit(opt == '?' ? 0 : 1);
+        }
+    }
+
+    if (options.transfer == 0 || options.transfer > EP_MAX_DATA) {
+        fprintf(stderr, "--transfer has to be 1-%d bytes\n", EP_MAX_DATA);
+        exit(1);
+    }
+    if (options.bias > 100) {
+        fprintf(stderr, "--bias has to be 0-100 percent\n");
+        exit(1);
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+
+    while (nanosleep(&ts, &ts) && errno == EINTR && !stopping) {
+    }
+}
+
+/**
+ * @brief Fill a transfer with the next data of a stream.
+ */
+static void stream_fill(struct stream *stream, uint8_t *buf, size_t len) {
+    if (options.counter) {
+        for (size_t i = 0; i < len; i++) {
+            buf[i] = stream->counter++;
+        }
+        return;
+    }
+
+    for (size_t filled = 0; filled < len;) {
+        ssize_t got = getrandom(buf + filled, len - filled, 0);
+        if (got < 0 && errno != EINTR) {
+            perror("getrandom");
+            exit(1);
+        }
+        filled += got > 0 ? got : 0;
+    }
+
+    // Lean towards STUCK_BYTE, using the random byte that follows it as the coin
+    if (options.bias) {
+        for (size_t i = 0; i + 1 < len; i++) {
+            if (buf[i + 1] * 100u < options.bias * 256u) {
+                buf[i] = STUCK_BYTE;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Stream on one bulk IN endpoint until the host goes away or the endpoints are torn down.
+ * Every write blocks until the host has taken the transfer, like the firmware's buffers waiting for an IN token.
+ */
+static void *stream_thread(void *arg) {
+    struct stream *stream = arg;
+    struct ep_io io;
+    uint64_t start = now_ns();
+    uint64_t sent = 0;
+    uint64_t transfers = 0;
+    uint64_t due;
+
+    while (!stopping) {
+        transfers++;
+
+        io.inner.ep = stream->handle;
+        io.inner.flags = 0;
+        io.inner.length = options.transfer;
+
+        if (options.short_every && transfers % options.short_every == 0) {
+            io.inner.length = options.transfer > 1 ? options.transfer / 2 - 1 : 0;
+        }
+
+        if (options.stuck_every && transfers % options.stuck_every == 0) {
+            memset(io.data, STUCK_BYTE, io.inner.length);
+        } else {
+            stream_fill(stream, io.data, io.inner.length);
+        }
+
+        if (options.stall_every && transfers % options.stall_every == 0) {
+            if (ioctl(raw_fd, USB_RAW_IOCTL_EP_SET_HALT, stream->handle) < 0) {
+                perror("ioctl(USB_RAW_IOCTL_EP_SET_HALT)");
+            } else {
+                sleep_ns(options.stall_ms * 1000000ull);
+                ioctl(raw_fd, USB_RAW_IOCTL_EP_CLEAR_HALT, stream->handle);
+            }
+        }
+
+        if (options.delay_ms) {
+            sleep_ns(options.delay_ms * 1000000ull);
+        }
+
+        // Hold the average at the rate, a slow host isn't made up for with a burst
+        if (options.rate) {
+            due = start + sent * 1000000000ull / options.rate;
+            if (due > now_ns()) {
+                sleep_ns(due - now_ns());
+            } else {
+                start = now_ns() - sent * 1000000000ull / options.rate;
+            }
+        }
+
+        int retval = ioctl(raw_fd, USB_RAW_IOCTL_EP_WRITE, &io);
+        if (retval < 0) {
+            if (stopping) {
+                break;
+            }
+            if (errno == ESHUTDOWN || errno == ECONNRESET || errno == EBUSY) {
+                // Reset or unplugged, the next SET_CONFIGURATION starts this endpoint over
+                fprintf(stderr, "EP%d stopped: %s\n", stream->index + 1, strerror(errno));
+                break;
+            }
+            perror("ioctl(USB_RAW_IOCTL_EP_WRITE)");
+            continue;
+        }
+
+        sent += retval;
+        device_count_transfer(stream->index, retval);
+    }
+
+    return NULL;
+}
+
+// Only there to interrupt a stream thread blocked in a write or a sleep
+static void wake_stream(int sig) {
+    (void) sig;
+}
+
+/**
+ * @brief Stop the stream threads and disable their endpoints, after a reset, a disconnect or a new
+ * SET_CONFIGURATION. A thread blocked in a write is interrupted, which dequeues its transfer.
+ */
+static void unconfigure(void) {
+    if (!configured) {
+        return;
+    }
+
+    stopping = 1;
+    for (int i = 0; i < num_streams; i++) {
+        // Keep signalling, one can land just before the thread blocks
+        while (streams[i].running && pthread_tryjoin_np(streams[i].thread, NULL) == EBUSY) {
+            pthread_kill(streams[i].thread, SIGUSR1);
+            sleep_ns(10000000ull);
+        }
+        streams[i].running = false;
+    }
+    stopping = 0;
+
+    for (int i = 0; i < num_streams; i++) {
+        if (ioctl(raw_fd, USB_RAW_IOCTL_EP_DISABLE, streams[i].handle) < 0) {
+            perror("ioctl(USB_RAW_IOCTL_EP_DISABLE)");
+        }
+    }
+
+    num_streams = 0;
+    configured = false;
+    fprintf(stderr, "unconfigured\n");
+}
+
+/**
+ * @brief SET_CONFIGURATION, enable the bulk IN endpoints and start streaming on them. Whatever an earlier
+ * SET_CONFIGURATION set up goes first, older kernels don't report the bus reset of a re-enumeration.
+ *
+ * @param value the configuration, 0 to only unconfigure
+ * @return false to stall the request
+ */
+static bool set_configuration(uint16_t value) {
+    uint8_t descs[DEVICE_NUM_STREAMS][DEVICE_EP_DESC_SIZE];
+    struct usb_endpoint_descriptor desc;
+    int count = device_endpoints(descs);
+
+    unconfigure();
+    if (value == 0) {
+        return true;
+    }
+
+    for (int i = 0; i < count; i++) {
+        memset(&desc, 0, sizeof(desc));
+        memcpy(&desc, descs[i], DEVICE_EP_DESC_SIZE);
+
+        streams[i].index = i;
+        streams[i].handle = ioctl(raw_fd, USB_RAW_IOCTL_EP_ENABLE, &desc);
+        if (streams[i].handle < 0) {
+            perror("ioctl(USB_RAW_IOCTL_EP_ENABLE)");
+            while (--i >= 0) {
+                ioctl(raw_fd, USB_RAW_IOCTL_EP_DISABLE, streams[i].handle);
+            }
+            return false;
+        }
+    }
+    num_streams = count;
+    configured = true;
+
+    if (ioctl(raw_fd, USB_RAW_IOCTL_VBUS_DRAW, device_max_power()) < 0) {
+        perror("ioctl(USB_RAW_IOCTL_VBUS_DRAW)");
+    }
+    if (ioctl(raw_fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0) {
+        perror("ioctl(USB_RAW_IOCTL_CONFIGURE)");
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        streams[i].running = pthread_create(&streams[i].thread, NULL, stream_thread, &streams[i]) == 0;
+    }
+
+    fprintf(stderr, "configured, streaming on %d endpoints\n", count);
+    return true;
+}
+
+/**
+ * @brief Answer a control request through ep0, stalling the ones the device doesn't know.
+ */
+static void handle_control(const struct usb_ctrlrequest *ctrl) {
+    struct ep0_io io;
+    struct device_setup setup = {
+            .bmRequestType = ctrl->bRequestType,
+            .bRequest = ctrl->bRequest,
+            .wValue = __le16_to_cpu(ctrl->wValue),
+            .wIndex = __le16_to_cpu(ctrl->wIndex),
+            .wLength = __le16_to_cpu(ctrl->wLength),
+    };
+    int len;
+
+    if (options.verbose) {
+        fprintf(stderr, "control 0x%02x 0x%02x wValue 0x%04x wIndex 0x%04x wLength %u\n", setup.bmRequestType,
+                setup.bRequest, setup.wValue, setup.wIndex, setup.wLength);
+    }
+
+    if ((setup.bmRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD && setup.bRequest == USB_REQ_SET_CONFIGURATION) {
+        len = set_configuration(setup.wValue & 0xff) ? 0 : -1;
+    } else {
+        len = device_control(&setup, io.data, sizeof(io.data));
+    }
+
+    if (len < 0) {
+        ioctl(raw_fd, USB_RAW_IOCTL_EP0_STALL, 0);
+        return;
+    }
+
+    io.inner.ep = 0;
+    io.inner.flags = 0;
+
+    if (setup.bmRequestType & USB_DIR_IN) {
+        io.inner.length = len;
+        if (ioctl(raw_fd, USB_RAW_IOCTL_EP0_WRITE, &io) < 0) {
+            perror("ioctl(USB_RAW_IOCTL_EP0_WRITE)");
+        }
+    } else {
+        // Taking the (empty) data stage acks the request
+        io.inner.length = setup.wLength < sizeof(io.data) ? setup.wLength : sizeof(io.data);
+        if (ioctl(raw_fd, USB_RAW_IOCTL_EP0_READ, &io) < 0) {
+            perror("ioctl(USB_RAW_IOCTL_EP0_READ)");
+        }
+    }
+}
+
+static void disconnect(int sig) {
+    (void) sig;
+    // Closing the raw_gadget file unbinds the gadget, which the host sees as an unplug
+    _exit(0);
+}
+
+int main(int argc, char **argv) {
+    struct usb_raw_init init;
+    struct control_event event;
+    struct sigaction wake = { .sa_handler = wake_stream };
+
+    parse_options(argc, argv);
+
+    // No SA_RESTART, so the signal fails a blocked write with EINTR
+    sigemptyset(&wake.sa_mask);
+    sigaction(SIGUSR1, &wake, NULL);
+
+    raw_fd = open("/dev/raw-gadget", O_RDWR);
+    if (raw_fd < 0) {
+        perror("open(/dev/raw-gadget), are dummy_hcd and raw_gadget loaded?");
+        return 1;
+    }
+
+    memset(&init, 0, sizeof(init));
+    strncpy((char *) init.driver_name, options.driver, UDC_NAME_LENGTH_MAX - 1);
+    strncpy((char *) init.device_name, options.device, UDC_NAME_LENGTH_MAX - 1);
+    // The Pico is a full speed device with 64 byte bulk packets
+    init.speed = USB_SPEED_FULL;
+
+    if (ioctl(raw_fd, USB_RAW_IOCTL_INIT, &init) < 0) {
+        perror("ioctl(USB_RAW_IOCTL_INIT)");
+        return 1;
+    }
+    if (ioctl(raw_fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+        perror("ioctl(USB_RAW_IOCTL_RUN)");
+        return 1;
+    }
+
+    if (options.disconnect_after) {
+        signal(SIGALRM, disconnect);
+        alarm(options.disconnect_after);
+    }
+
+    fprintf(stderr, "pico rng emulator attached to %s\n", options.device);
+
+    while (true) {
+        event.inner.type = 0;
+        event.inner.length = sizeof(event.ctrl);
+
+        if (ioctl(raw_fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ioctl(USB_RAW_IOCTL_EVENT_FETCH)");
+            return 1;
+        }
+
+        switch (event.inner.type) {
+            case USB_RAW_EVENT_CONNECT:
+                fprintf(stderr, "connected\n");
+                break;
+
+            case USB_RAW_EVENT_CONTROL:
+                handle_control(&event.ctrl);
+                break;
+
+            case EVENT_RESET:
+            case EVENT_DISCONNECT:
+                // The host configures the device again once it has enumerated it
+                fprintf(stderr, "%s\n", event.inner.type == EVENT_RESET ? "reset" : "disconnected");
+                unconfigure();
+                break;
+
+            default:
+                // Suspend and resume on newer kernels
+                if (options.verbose) {
+                    fprintf(stderr, "event %u\n", event.inner.type);
+                }
+                break;
+        }
+    }
+}
@@ -0,0 +1,123 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "adc_sampler.h"
+
+// Pico
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+
+#define ADC_SAMPLER_RING_MASK (ADC_SAMPLER_RING_SIZE - 1u)
+
+// Samples this close to being overwritten are never handed out, so
+// a copy in progress can't be overtaken by the DMA
+#define ADC_SAMPLER_GUARD (ADC_SAMPLER_RING_SIZE / 4u)
+
+// Transfers per DMA run. A power of two so the running sample count wraps cleanly at 2^32
+#define ADC_SAMPLER_DMA_RUN (1u << 30)
+
+// The DMA ring wraps on its write address, so the buffer must be aligned to its size
+static uint16_t sample_ring[ADC_SAMPLER_RING_SIZE]
+        __attribute__((aligned(ADC_SAMPLER_RING_SIZE * sizeof(uint16_t))));
+
+static uint dma_chan;
+
+// Number of completed DMA runs, bumped by the DMA IRQ
+static volatile uint32_t dma_runs = 0;
+
+// Running count of samples handed out by adc_sampler_read()
+static uint32_t consumed = 0;
+
+/**
+ * @brief DMA complete interrupt. Re-arm the channel so the ADC keeps free-running into the ring.
+ *
+ */
+static void adc_sampler_dma_irq(void) {
+    dma_channel_acknowledge_irq0(dma_chan);
+    dma_runs++;
+    // The write address has wrapped within the ring, so only the count needs reloading
+    dma_channel_set_trans_count(dma_chan, ADC_SAMPLER_DMA_RUN, true);
+}
+
+void adc_sampler_init(uint input) {
+    adc_init();
+    adc_gpio_init(26 + input);
+    adc_select_input(input);
+
+    // Push every conversion into the FIFO and raise DREQ as soon as one sample is there.
+    // Keep the full 12 bits, the extraction wants the LSBs.
+    adc_fifo_setup(true, true, 1, false, false);
+
+    // Back to back conversions, 96 cycles of the 48MHz ADC clock each (500 ksps)
+    adc_set_clkdiv(0);
+
+    dma_chan = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(dma_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    // Ring size is given in bytes
+    channel_config_set_ring(&c, true, ADC_SAMPLER_RING_BITS + 1);
+    channel_config_set_dreq(&c, DREQ_ADC);
+    dma_channel_configure(dma_chan, &c, sample_ring, &adc_hw->fifo, ADC_SAMPLER_DMA_RUN, false);
+
+    dma_channel_set_irq0_enabled(dma_chan, true);
+    irq_set_exclusive_handler(DMA_IRQ_0, adc_sampler_dma_irq);
+    irq_set_enabled(DMA_IRQ_0, true);
+}
+
+void adc_sampler_start(void) {
+    dma_channel_start(dma_chan);
+    adc_run(true);
+}
+
+void adc_sampler_pause(void) {
+    adc_run(false);
+}
+
+void adc_sampler_resume(void) {
+    adc_run(true);
+}
+
+uint32_t adc_sampler_produced(void) {
+    return (uint32_t) adc_sampler_samples();
+}
+
+uint64_t adc_sampler_samples(void) {
+    uint32_t runs;
+    uint32_t remaining;
+
+    // Retry if the DMA IRQ re-armed the channel between the two reads
+    do {
+        runs = dma_runs;
+        remaining = dma_hw->ch[dma_chan].transfer_count;
+    } while (runs != dma_runs);
+
+    return (uint64_t) runs * ADC_SAMPLER_DMA_RUN + (ADC_SAMPLER_DMA_RUN - remaining);
+}
+
+uint32_t adc_sampler_read(uint16_t *dst, uint32_t count) {
+    uint32_t produced = adc_sampler_produced();
+    uint32_t available = produced - consumed;
+
+    // The DMA has lapped us. Skip what was overwritten, there is always fresh noise.
+    if (available > ADC_SAMPLER_RING_SIZE - ADC_SAMPLER_GUARD) {
+        available = ADC_SAMPLER_RING_SIZE - ADC_SAMPLER_GUARD;
+        consumed = produced - available;
+    }
+
+    if (count > available) {
+        count = available;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        dst[i] = sample_ring[(consumed + i) & ADC_SAMPLER_RING_MASK];
+    }
+    consumed += count;
+
+    return count;
+}
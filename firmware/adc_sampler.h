@@ -0,0 +1,69 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef ADC_SAMPLER_H_
+#define ADC_SAMPLER_H_
+
+#include "pico/types.h"
+
+// log2 of the number of 16 bit samples held in the DMA ring buffer
+#ifndef ADC_SAMPLER_RING_BITS
+#define ADC_SAMPLER_RING_BITS 12
+#endif
+
+#define ADC_SAMPLER_RING_SIZE (1u << ADC_SAMPLER_RING_BITS)
+
+/**
+ * @brief Set up the ADC in free-running FIFO mode and claim a DMA channel that
+ * copies every conversion into the sample ring buffer.
+ *
+ * @param input the ADC input to sample (0-3, GPIO 26-29)
+ */
+void adc_sampler_init(uint input);
+
+/**
+ * @brief Start the ADC conversions and the DMA channel draining them.
+ *
+ */
+void adc_sampler_start(void);
+
+/**
+ * @brief Stop the ADC conversions. The DMA channel stays armed, waiting on the next conversion.
+ *
+ */
+void adc_sampler_pause(void);
+
+/**
+ * @brief Start the ADC conversions again after adc_sampler_pause().
+ *
+ */
+void adc_sampler_resume(void);
+
+/**
+ * @brief Total number of samples written to the ring buffer so far. Wraps at 2^32.
+ *
+ * @return uint32_t
+ */
+uint32_t adc_sampler_produced(void);
+
+/**
+ * @brief Total number of conversions since the sampler was started. Doesn't wrap in practice.
+ *
+ * @return uint64_t
+ */
+uint64_t adc_sampler_samples(void);
+
+/**
+ * @brief Copy out samples that have already been harvested. Never waits on a conversion,
+ * so fewer than count samples are returned when the ring runs dry.
+ *
+ * @param dst the buffer to copy the samples to
+ * @param count the maximum number of samples to copy
+ * @return the number of samples copied
+ */
+uint32_t adc_sampler_read(uint16_t *dst, uint32_t count);
+
+#endif
@@ -0,0 +1,117 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "chacha20_drbg.h"
+
+// For memcpy
+#include <string.h>
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+// Key, nonce and seed material taken from one block when reseeding
+#define CHACHA20_DRBG_REKEY_LEN (sizeof(((struct chacha20_drbg *) 0)->key) + sizeof(((struct chacha20_drbg *) 0)->nonce))
+
+/**
+ * @brief The ChaCha20 block function (RFC 7539). The Cortex-M0+ is little endian,
+ * so the words are already in output byte order.
+ *
+ * @param drbg the generator holding the key and nonce
+ * @param counter the block counter
+ * @param out the 64 byte keystream block
+ */
+static void chacha20_block(const struct chacha20_drbg *drbg, uint32_t counter, uint32_t out[16]) {
+    uint32_t in[16] = {
+            0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+            drbg->key[0], drbg->key[1], drbg->key[2], drbg->key[3],
+            drbg->key[4], drbg->key[5], drbg->key[6], drbg->key[7],
+            counter, drbg->nonce[0], drbg->nonce[1], drbg->nonce[2]
+    };
+    uint32_t x[16];
+
+    memcpy(x, in, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        // Column rounds
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        // Diagonal rounds
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        out[i] = x[i] + in[i];
+    }
+}
+
+void chacha20_drbg_init(struct chacha20_drbg *drbg, uint32_t reseed_interval) {
+    memset(drbg, 0, sizeof(*drbg));
+    drbg->reseed_interval = reseed_interval;
+}
+
+void chacha20_drbg_reseed(struct chacha20_drbg *drbg, const uint8_t *seed, uint32_t len) {
+    uint32_t block[16];
+
+    // Absorb the seed a block at a time: XOR it into fresh keystream and make that the new key and nonce
+    do {
+        uint32_t n = len < CHACHA20_DRBG_REKEY_LEN ? len : CHACHA20_DRBG_REKEY_LEN;
+        uint8_t *ks = (uint8_t *) block;
+
+        chacha20_block(drbg, 0, block);
+        for (uint32_t i = 0; i < n; i++) {
+            ks[i] ^= seed[i];
+        }
+        memcpy(drbg->key, ks, sizeof(drbg->key));
+        memcpy(drbg->nonce, ks + sizeof(drbg->key), sizeof(drbg->nonce));
+
+        seed += n;
+        len -= n;
+    } while (len);
+
+    memset(block, 0, sizeof(block));
+    drbg->generated = 0;
+    drbg->seeded = true;
+}
+
+void chacha20_drbg_generate(struct chacha20_drbg *drbg, uint8_t *out, uint32_t len) {
+    uint32_t block[16];
+    uint32_t counter = 0;
+    uint8_t *ks = (uint8_t *) block;
+
+    drbg->generated += len;
+
+    // The first 32 bytes of keystream are the next key, the rest of the block is output
+    chacha20_block(drbg, counter++, block);
+    uint32_t n = len < sizeof(block) - sizeof(drbg->key) ? len : sizeof(block) - sizeof(drbg->key);
+    memcpy(out, ks + sizeof(drbg->key), n);
+    out += n;
+    len -= n;
+
+    uint32_t next_key[8];
+    memcpy(next_key, ks, sizeof(next_key));
+
+    while (len) {
+        chacha20_block(drbg, counter++, block);
+        n = len < sizeof(block) ? len : sizeof(block);
+        memcpy(out, ks, n);
+        out += n;
+        len -= n;
+    }
+
+    memcpy(drbg->key, next_key, sizeof(drbg->key));
+    memset(next_key, 0, sizeof(next_key));
+    memset(block, 0, sizeof(block));
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef CHACHA20_DRBG_H_
+#define CHACHA20_DRBG_H_
+
+#include "pico/types.h"
+
+// Bytes generated between reseeds from the ADC
+#ifndef CHACHA20_DRBG_RESEED_INTERVAL
+#define CHACHA20_DRBG_RESEED_INTERVAL 65536
+#endif
+
+// ChaCha20 keystream generator with fast key erasure: the first 32 bytes of
+// every request become the key for the next one, so earlier output can't be
+// recovered from the state.
+struct chacha20_drbg {
+    uint32_t key[8];
+    uint32_t nonce[3];
+
+    // Bytes generated since the last reseed
+    uint32_t generated;
+    volatile uint32_t reseed_interval;
+    bool seeded;
+};
+
+/**
+ * @brief Set up an unseeded generator. Nothing can be generated before the first reseed.
+ *
+ * @param drbg the generator
+ * @param reseed_interval the number of bytes to generate between reseeds
+ */
+void chacha20_drbg_init(struct chacha20_drbg *drbg, uint32_t reseed_interval);
+
+/**
+ * @brief Mix seed material into the key and nonce.
+ *
+ * @param drbg the generator
+ * @param seed the seed material, i.e. extracted ADC noise
+ * @param len the length of seed
+ */
+void chacha20_drbg_reseed(struct chacha20_drbg *drbg, const uint8_t *seed, uint32_t len);
+
+/**
+ * @brief Returns true if the generator has never been seeded or has reached its reseed interval.
+ *
+ * @param drbg the generator
+ * @return true
+ * @return false
+ */
+static inline bool chacha20_drbg_reseed_due(const struct chacha20_drbg *drbg) {
+    return !drbg->seeded || drbg->generated >= drbg->reseed_interval;
+}
+
+/**
+ * @brief Fill out with generator output. The generator must have been seeded.
+ *
+ * @param drbg the generator
+ * @param out the buffer to fill
+ * @param len the length of out
+ */
+void chacha20_drbg_generate(struct chacha20_drbg *drbg, uint8_t *out, uint32_t len);
+
+#endif
@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "extractor.h"
+
+void extractor_init(struct extractor *x, uint bits, enum extractor_debias debias) {
+    if (bits < 1) {
+        bits = 1;
+    } else if (bits > 12) {
+        bits = 12;
+    }
+
+    // Both debiasing schemes work on pairs of bits
+    if (debias != EXTRACTOR_DEBIAS_NONE && (bits & 1u)) {
+        bits++;
+    }
+
+    x->bits = bits;
+    x->mask = (1u << bits) - 1u;
+    x->debias = debias;
+    x->acc = 0;
+    x->acc_bits = 0;
+}
+
+/**
+ * @brief Reduce the kept bits of one sample to the bits that are actually output.
+ *
+ * @param x the extractor
+ * @param v the kept bits of the sample
+ * @param nbits set to the number of output bits
+ * @return the output bits, LSB first
+ */
+static inline uint32_t extractor_debias(const struct extractor *x, uint32_t v, uint *nbits) {
+    uint32_t out = 0;
+    uint n = 0;
+
+    switch (x->debias) {
+        case EXTRACTOR_DEBIAS_VON_NEUMANN:
+            for (uint i = 0; i < x->bits; i += 2) {
+                uint32_t a = (v >> i) & 1u;
+                uint32_t b = (v >> (i + 1)) & 1u;
+                if (a != b) {
+                    out |= a << n++;
+                }
+            }
+            break;
+
+        case EXTRACTOR_DEBIAS_XOR:
+            for (uint i = 0; i < x->bits; i += 2) {
+                out |= (((v >> i) ^ (v >> (i + 1))) & 1u) << n++;
+            }
+            break;
+
+        default:
+            out = v;
+            n = x->bits;
+    }
+
+    *nbits = n;
+    return out;
+}
+
+uint32_t extractor_run(struct extractor *x, const uint16_t *samples, uint32_t count, uint8_t *out) {
+    uint32_t acc = x->acc;
+    uint acc_bits = x->acc_bits;
+    uint32_t len = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint nbits;
+        uint32_t bits = extractor_debias(x, samples[i] & x->mask, &nbits);
+
+        // acc_bits is below 8 here, so at most 19 bits are ever held
+        acc |= bits << acc_bits;
+        acc_bits += nbits;
+
+        while (acc_bits >= 8) {
+            out[len++] = (uint8_t) acc;
+            acc >>= 8;
+            acc_bits -= 8;
+        }
+    }
+
+    x->acc = acc;
+    x->acc_bits = acc_bits;
+
+    return len;
+}
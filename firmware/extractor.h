@@ -0,0 +1,62 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef EXTRACTOR_H_
+#define EXTRACTOR_H_
+
+#include "pico/types.h"
+
+// Number of LSBs kept from each 12 bit ADC sample (1-12). The high bits of
+// a floating input barely move, the noise is in the bottom few.
+#ifndef EXTRACTOR_BITS
+#define EXTRACTOR_BITS 4
+#endif
+
+// Debiasing applied to the kept bits, one of enum extractor_debias
+#ifndef EXTRACTOR_DEBIAS
+#define EXTRACTOR_DEBIAS EXTRACTOR_DEBIAS_NONE
+#endif
+
+enum extractor_debias {
+    // Pack the kept bits as they are
+    EXTRACTOR_DEBIAS_NONE = 0,
+    // 01 -> 0, 10 -> 1, 00 and 11 are dropped. Unbiased for independent bits, ~1/4 the rate
+    EXTRACTOR_DEBIAS_VON_NEUMANN,
+    // XOR each pair of bits into one. Reduces bias, 1/2 the rate
+    EXTRACTOR_DEBIAS_XOR
+};
+
+// Bit extraction state, carries the bits that don't fill a whole byte yet between calls
+struct extractor {
+    uint bits;
+    uint32_t mask;
+    enum extractor_debias debias;
+
+    uint32_t acc;
+    uint acc_bits;
+};
+
+/**
+ * @brief Set up an extractor.
+ *
+ * @param x the extractor
+ * @param bits the number of LSBs to keep per sample (1-12, must be even unless debias is EXTRACTOR_DEBIAS_NONE)
+ * @param debias the debiasing to apply
+ */
+void extractor_init(struct extractor *x, uint bits, enum extractor_debias debias);
+
+/**
+ * @brief Extract the LSBs of count samples and pack them densely into out.
+ *
+ * @param x the extractor
+ * @param samples the raw ADC samples
+ * @param count the number of samples
+ * @param out the packed output, must hold at least (count * bits) / 8 + 1 bytes
+ * @return the number of whole bytes written to out
+ */
+uint32_t extractor_run(struct extractor *x, const uint16_t *samples, uint32_t count, uint8_t *out);
+
+#endif
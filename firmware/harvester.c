@@ -0,0 +1,276 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "harvester.h"
+
+// Pico
+#include "pico/stdlib.h"
+
+// For memset
+#include <string.h>
+
+#include "adc_sampler.h"
+#include "chacha20_drbg.h"
+#include "extractor.h"
+#include "health.h"
+#include "spsc_ring.h"
+
+// Samples pulled from the ADC ring per pass
+#define HARVESTER_CHUNK 64
+
+// Worst case output of the extractor for a full chunk
+#define HARVESTER_EXTRACT_MAX ((HARVESTER_CHUNK * 12) / 8 + 1)
+
+// Conditioned bytes generated per pass. Every pass also spends 32 bytes of keystream on rekeying.
+#define HARVESTER_CONDITIONED_CHUNK 256
+
+// Extracted bytes mixed into the generator on every reseed
+#define HARVESTER_SEED_LEN 64
+
+// Consecutive passing samples needed before output resumes after a health test failure
+#ifndef HARVESTER_HEALTH_QUARANTINE
+#define HARVESTER_HEALTH_QUARANTINE 1024
+#endif
+
+static uint8_t raw_buf[1u << HARVESTER_RING_BITS];
+static uint8_t conditioned_buf[1u << HARVESTER_RING_BITS];
+
+// Core1 produces, the USB IRQ on core0 consumes
+static struct spsc_ring rings[HARVESTER_NUM_STREAMS] = {
+        [HARVESTER_STREAM_RAW] = SPSC_RING_INIT(raw_buf),
+        [HARVESTER_STREAM_CONDITIONED] = SPSC_RING_INIT(conditioned_buf),
+};
+
+static struct extractor extractor;
+
+static struct chacha20_drbg drbg;
+
+static struct health_tests health;
+
+// Samples still to pass the health tests before anything is extracted again. Starts out
+// set so the tests see some samples before the first output.
+static volatile uint32_t health_quarantine = HARVESTER_HEALTH_QUARANTINE;
+
+// Bytes pushed into the rings. 64 bits can't be stored atomically, so core1 bumps
+// produced_seq around every update and core0 retries a read that overlapped one.
+static volatile uint32_t produced_seq = 0;
+static volatile uint64_t bytes_produced = 0;
+
+// Ring fill levels seen by the consumer, only touched on core0
+static uint16_t ring_high[HARVESTER_NUM_STREAMS];
+static uint16_t ring_low[HARVESTER_NUM_STREAMS] = {
+        [HARVESTER_STREAM_RAW] = UINT16_MAX,
+        [HARVESTER_STREAM_CONDITIONED] = UINT16_MAX,
+};
+
+// Set by core0 while the bus is suspended. Core1 stops the ADC and sleeps until it clears.
+static volatile bool parked = false;
+
+// Extracted bytes set aside for the next reseed. They never appear on the raw stream.
+static uint8_t seed[HARVESTER_SEED_LEN];
+static uint32_t seed_len = 0;
+
+/**
+ * @brief Core1 side. Push bytes into a stream ring and account for them.
+ *
+ * @param ring the stream ring
+ * @param src the bytes to push
+ * @param len the number of bytes in src
+ */
+static void harvester_push(struct spsc_ring *ring, const uint8_t *src, uint32_t len) {
+    len = spsc_ring_push(ring, src, len);
+
+    produced_seq++;
+    __dmb();
+    bytes_produced += len;
+    __dmb();
+    produced_seq++;
+}
+
+/**
+ * @brief Throw away everything derived from the samples before a health test failure:
+ * the extractor's partial byte, the seed material and the generator state.
+ *
+ */
+static void harvester_health_failed(void) {
+    extractor_init(&extractor, EXTRACTOR_BITS, EXTRACTOR_DEBIAS);
+
+    memset(seed, 0, sizeof(seed));
+    seed_len = 0;
+
+    // Conditioned output stops until a reseed from samples that passed
+    drbg.seeded = false;
+
+    health_quarantine = HARVESTER_HEALTH_QUARANTINE;
+}
+
+/**
+ * @brief Pull whatever the ADC has harvested, up to one chunk, through the health tests
+ * and then the extractor. A chunk that fails is dropped whole, so no byte is ever extracted
+ * from a sample more than one chunk away from a failure the tests can see.
+ *
+ * @param bytes the extracted bytes, must hold HARVESTER_EXTRACT_MAX bytes
+ * @return the number of bytes extracted
+ */
+static uint32_t harvester_extract(uint8_t *bytes) {
+    uint16_t samples[HARVESTER_CHUNK];
+
+    uint32_t count = adc_sampler_read(samples, HARVESTER_CHUNK);
+
+    if (!health_run(&health, samples, count)) {
+        harvester_health_failed();
+        return 0;
+    }
+
+    if (health_quarantine) {
+        health_quarantine = count < health_quarantine ? health_quarantine - count : 0;
+        return 0;
+    }
+
+    return extractor_run(&extractor, samples, count, bytes);
+}
+
+/**
+ * @brief Raw stream. Top up the seed material, then push the extracted bits into the raw ring.
+ *
+ * @return false if there was nothing to do
+ */
+static bool harvester_raw(void) {
+    struct spsc_ring *ring = &rings[HARVESTER_STREAM_RAW];
+    uint8_t bytes[HARVESTER_EXTRACT_MAX];
+    uint8_t *p = bytes;
+    bool need_seed = seed_len < sizeof(seed);
+
+    // Leave the ADC lapping its own ring until core0 makes room
+    if (!need_seed && spsc_ring_space(ring) < sizeof(bytes)) {
+        return false;
+    }
+
+    uint32_t len = harvester_extract(bytes);
+
+    if (need_seed) {
+        uint32_t n = len < sizeof(seed) - seed_len ? len : sizeof(seed) - seed_len;
+        memcpy(&seed[seed_len], p, n);
+        seed_len += n;
+        p += n;
+        len -= n;
+    }
+
+    harvester_push(ring, p, len);
+    return true;
+}
+
+/**
+ * @brief Conditioned stream. Reseed the generator when it is due and fill the conditioned
+ * ring with its output.
+ *
+ * @return false if there was nothing to do
+ */
+static bool harvester_conditioned(void) {
+    struct spsc_ring *ring = &rings[HARVESTER_STREAM_CONDITIONED];
+    uint8_t bytes[HARVESTER_CONDITIONED_CHUNK];
+
+    if (seed_len == sizeof(seed) && chacha20_drbg_reseed_due(&drbg)) {
+        chacha20_drbg_reseed(&drbg, seed, sizeof(seed));
+        memset(seed, 0, sizeof(seed));
+        seed_len = 0;
+    }
+
+    if (!drbg.seeded || spsc_ring_space(ring) < sizeof(bytes)) {
+        return false;
+    }
+
+    chacha20_drbg_generate(&drbg, bytes, sizeof(bytes));
+    harvester_push(ring, bytes, sizeof(bytes));
+    return true;
+}
+
+void harvester_core1_main(void) {
+    extractor_init(&extractor, EXTRACTOR_BITS, EXTRACTOR_DEBIAS);
+    chacha20_drbg_init(&drbg, CHACHA20_DRBG_RESEED_INTERVAL);
+    health_init(&health, HEALTH_MIN_ENTROPY);
+
+    // Set up here so the DMA IRQ is serviced by core1
+    adc_sampler_init(0);
+    adc_sampler_start();
+
+    // Both streams are produced all the time so they can be drained concurrently
+    while (1) {
+        if (parked) {
+            // Nothing is drained while suspended, the rings are already full
+            adc_sampler_pause();
+            while (parked) {
+                __wfe();
+            }
+            adc_sampler_resume();
+        }
+
+        bool busy = harvester_raw();
+        busy |= harvester_conditioned();
+        if (!busy) {
+            tight_loop_contents();
+        }
+    }
+}
+
+void harvester_set_suspended(bool suspended) {
+    parked = suspended;
+    // Wake core1 from __wfe() to see the change
+    __sev();
+}
+
+uint32_t harvester_read(enum harvester_stream stream, uint8_t *buf, uint32_t len) {
+    uint32_t count = spsc_ring_count(&rings[stream]);
+
+    if (count > ring_high[stream]) {
+        ring_high[stream] = count;
+    }
+    if (count < ring_low[stream]) {
+        ring_low[stream] = count;
+    }
+
+    return spsc_ring_pop(&rings[stream], buf, len);
+}
+
+uint64_t harvester_bytes_produced(void) {
+    uint32_t seq;
+    uint64_t bytes;
+
+    do {
+        seq = produced_seq;
+        __dmb();
+        bytes = bytes_produced;
+        __dmb();
+    } while ((seq & 1u) || seq != produced_seq);
+
+    return bytes;
+}
+
+void harvester_get_watermarks(enum harvester_stream stream, uint16_t *high, uint16_t *low) {
+    *high = ring_high[stream];
+    *low = ring_low[stream];
+}
+
+void harvester_reset_watermarks(void) {
+    for (int i = 0; i < HARVESTER_NUM_STREAMS; i++) {
+        ring_high[i] = 0;
+        ring_low[i] = UINT16_MAX;
+    }
+}
+
+void harvester_set_reseed_interval(uint32_t bytes) {
+    drbg.reseed_interval = bytes;
+}
+
+uint32_t harvester_health_failures(uint32_t *rct, uint32_t *apt) {
+    *rct = health.rct_failures;
+    *apt = health.apt_failures;
+    return *rct + *apt;
+}
+
+bool harvester_health_ok(void) {
+    return health_quarantine == 0;
+}
@@ -0,0 +1,99 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef HARVESTER_H_
+#define HARVESTER_H_
+
+#include "pico/types.h"
+
+// log2 of the size in bytes of each ring between core1 and the USB core
+#ifndef HARVESTER_RING_BITS
+#define HARVESTER_RING_BITS 12
+#endif
+
+// The streams core1 produces, each through its own ring. Also the wValue of PICO_RNG_REQUEST_SET_MODE.
+enum harvester_stream {
+    // Extracted ADC bits, as fast as the ADC can make them
+    HARVESTER_STREAM_RAW = 0,
+    // ChaCha20 output reseeded from the extracted ADC bits, as fast as USB can take it
+    HARVESTER_STREAM_CONDITIONED,
+    HARVESTER_NUM_STREAMS
+};
+
+// Stream served on EP1 at power up
+#ifndef HARVESTER_DEFAULT_MODE
+#define HARVESTER_DEFAULT_MODE HARVESTER_STREAM_RAW
+#endif
+
+/**
+ * @brief Core1 entry point. Owns the ADC sampler and keeps the output rings topped up. Never returns.
+ *
+ */
+void harvester_core1_main(void);
+
+/**
+ * @brief Core0 side. Park core1 and the ADC while the bus is suspended, or wake them again. Safe from an IRQ.
+ *
+ * @param suspended whether the bus is suspended
+ */
+void harvester_set_suspended(bool suspended);
+
+/**
+ * @brief Core0 side. Copy out up to len bytes of a stream already harvested by core1. Never waits.
+ *
+ * @param stream the stream to read
+ * @param buf the buffer to store the random data in
+ * @param len the size of buf
+ * @return the number of bytes stored in buf
+ */
+uint32_t harvester_read(enum harvester_stream stream, uint8_t *buf, uint32_t len);
+
+/**
+ * @brief Total number of bytes core1 has put in the stream rings. Safe to call from core0.
+ *
+ * @return uint64_t
+ */
+uint64_t harvester_bytes_produced(void);
+
+/**
+ * @brief Highest and lowest fill level of a stream ring seen by harvester_read() since the last reset.
+ *
+ * @param stream the stream
+ * @param high set to the high watermark in bytes
+ * @param low set to the low watermark in bytes
+ */
+void harvester_get_watermarks(enum harvester_stream stream, uint16_t *high, uint16_t *low);
+
+/**
+ * @brief Start the ring watermarks over.
+ *
+ */
+void harvester_reset_watermarks(void);
+
+/**
+ * @brief Set the number of conditioned bytes generated between reseeds.
+ *
+ * @param bytes the reseed interval in bytes
+ */
+void harvester_set_reseed_interval(uint32_t bytes);
+
+/**
+ * @brief Number of times the continuous health tests have failed since power up.
+ *
+ * @param rct set to the Repetition Count Test failures
+ * @param apt set to the Adaptive Proportion Test failures
+ * @return the total number of failures
+ */
+uint32_t harvester_health_failures(uint32_t *rct, uint32_t *apt);
+
+/**
+ * @brief Whether output is flowing, false while core1 holds it back after a health test failure.
+ *
+ * @return bool
+ */
+bool harvester_health_ok(void);
+
+#endif
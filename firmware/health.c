@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "health.h"
+
+// APT cutoffs for a 512 sample window, 1 + CRITBINOM(512, 2^-H, 1 - 2^-20), indexed by H.
+// Matches SP 800-90B table 2.
+static const uint16_t apt_cutoffs[] = { 0, 311, 177, 103, 62, 39, 25, 18, 13 };
+
+void health_init(struct health_tests *h, uint min_entropy) {
+    if (min_entropy < 1) {
+        min_entropy = 1;
+    } else if (min_entropy > 8) {
+        min_entropy = 8;
+    }
+
+    // C = 1 + ceil(20 / H)
+    h->rct_cutoff = 1 + (20 + min_entropy - 1) / min_entropy;
+    h->rct_count = 0;
+
+    h->apt_cutoff = apt_cutoffs[min_entropy];
+    h->apt_seen = HEALTH_APT_WINDOW;
+
+    h->rct_failures = 0;
+    h->apt_failures = 0;
+}
+
+bool health_run(struct health_tests *h, const uint16_t *samples, uint32_t count) {
+    bool ok = true;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t sample = samples[i];
+
+        if (h->rct_count && sample == h->rct_last) {
+            if (++h->rct_count >= h->rct_cutoff) {
+                h->rct_failures++;
+                h->rct_count = 0;
+                ok = false;
+            }
+        } else {
+            h->rct_last = sample;
+            h->rct_count = 1;
+        }
+
+        if (h->apt_seen == HEALTH_APT_WINDOW) {
+            // Start a new window with this sample as the reference
+            h->apt_ref = sample;
+            h->apt_count = 1;
+            h->apt_seen = 1;
+        } else {
+            h->apt_seen++;
+            if (sample == h->apt_ref && ++h->apt_count >= h->apt_cutoff) {
+                h->apt_failures++;
+                h->apt_seen = HEALTH_APT_WINDOW;
+                ok = false;
+            }
+        }
+    }
+
+    return ok;
+}
@@ -0,0 +1,57 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef HEALTH_H_
+#define HEALTH_H_
+
+#include "pico/types.h"
+
+// Assessed min-entropy of one raw 12 bit ADC sample in whole bits (1-8). Sets the test cutoffs.
+#ifndef HEALTH_MIN_ENTROPY
+#define HEALTH_MIN_ENTROPY 2
+#endif
+
+// Adaptive Proportion Test window for non-binary samples (SP 800-90B 4.4.2)
+#define HEALTH_APT_WINDOW 512
+
+// Continuous SP 800-90B health tests on the raw samples. Both are incremental, O(1) per
+// sample with no window buffering, and use a false positive rate of 2^-20.
+struct health_tests {
+    // Repetition Count Test (4.4.1): too many identical samples in a row
+    uint16_t rct_last;
+    uint32_t rct_count;
+    uint32_t rct_cutoff;
+
+    // Adaptive Proportion Test (4.4.2): the first sample of a window turns up too often within it
+    uint16_t apt_ref;
+    uint32_t apt_count;
+    uint32_t apt_seen;
+    uint32_t apt_cutoff;
+
+    volatile uint32_t rct_failures;
+    volatile uint32_t apt_failures;
+};
+
+/**
+ * @brief Set up the tests and their cutoffs.
+ *
+ * @param h the tests
+ * @param min_entropy the assessed min-entropy per sample in whole bits (1-8)
+ */
+void health_init(struct health_tests *h, uint min_entropy);
+
+/**
+ * @brief Run both tests over a batch of samples. A failing test starts over, so the next
+ * failure is reported independently.
+ *
+ * @param h the tests
+ * @param samples the raw ADC samples
+ * @param count the number of samples
+ * @return false if either test failed on any of the samples
+ */
+bool health_run(struct health_tests *h, const uint16_t *samples, uint32_t count);
+
+#endif
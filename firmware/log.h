@@ -0,0 +1,55 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdio.h>
+
+/**
+ * Log levels. Anything above PICO_RNG_LOG_LEVEL compiles away entirely, arguments included.
+ **/
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERR   1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef PICO_RNG_LOG_LEVEL
+#define PICO_RNG_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Keeps the format string checked when the level is compiled out
+#define LOGGER_NOP(fmt, args ...) do { if (0) printf(fmt, ## args); } while (0)
+
+/**
+ * Logger Macros
+ **/
+#if PICO_RNG_LOG_LEVEL >= LOG_LEVEL_ERR
+#define LOGGER_ERR(fmt, args ...) printf("[err]  %s(%d): " fmt, __FUNCTION__, __LINE__, ## args)
+#else
+#define LOGGER_ERR(fmt, args ...) LOGGER_NOP(fmt, ## args)
+#endif
+
+#if PICO_RNG_LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOGGER_WARN(fmt, args ...) printf("[warn]  %s(%d): " fmt, __FUNCTION__, __LINE__, ## args)
+#else
+#define LOGGER_WARN(fmt, args ...) LOGGER_NOP(fmt, ## args)
+#endif
+
+#if PICO_RNG_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOGGER_INFO(fmt, args ...) printf("[info]  %s(%d): " fmt, __FUNCTION__, __LINE__, ## args)
+#else
+#define LOGGER_INFO(fmt, args ...) LOGGER_NOP(fmt, ## args)
+#endif
+
+#if PICO_RNG_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOGGER_DEBUG(fmt, args ...) printf("[debug]  %s(%d): " fmt, __FUNCTION__, __LINE__, ## args)
+#else
+#define LOGGER_DEBUG(fmt, args ...) LOGGER_NOP(fmt, ## args)
+#endif
+
+#endif
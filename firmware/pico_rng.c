@@ -9,6 +9,7 @@
 
 // Pico
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
 #include "hardware/gpio.h"
 #include "hardware/adc.h"
 
@@ -28,6 +29,13 @@
 
 // Device descriptors
 #include "pico_rng.h"
+// Entropy harvesting on core1
+#include "harvester.h"
+// ADC conversion count for the stats
+#include "adc_sampler.h"
+// Compile time log levels and the in-RAM trace ring
+#include "log.h"
+#include "trace.h"
 
 #define usb_hw_set hw_set_alias(usb_hw)
 #define usb_hw_clear hw_clear_alias(usb_hw)
@@ -36,17 +44,49 @@
 void ep0_in_handler(uint8_t *buf, uint16_t len);
 void ep0_out_handler(uint8_t *buf, uint16_t len);
 void ep1_in_handler(uint8_t *buf, uint16_t len);
+void ep2_in_handler(uint8_t *buf, uint16_t len);
+void ep3_in_handler(uint8_t *buf, uint16_t len);
+uint16_t get_random_data(enum harvester_stream stream, uint8_t *buf, uint16_t len);
 
 // Global device address
 static bool should_set_address = false;
 static uint8_t dev_addr = 0;
 static volatile bool configured = false;
 
+// Set by PICO_RNG_REQUEST_DUMP_TRACE, the dump itself happens in main()
+static volatile bool trace_dump_requested = false;
+
+// Set while the host has the bus suspended, e.g. when the driver autosuspends an idle device
+static volatile bool suspended = false;
+
+// Counters kept by the USB core for PICO_RNG_REQUEST_GET_STATS
+static struct {
+    uint32_t packets_sent;
+    uint32_t irq_count;
+    uint32_t irq_min_us;
+    uint32_t irq_max_us;
+    uint64_t irq_total_us;
+} usb_stats = { .irq_min_us = UINT32_MAX };
+
 // Global data buffer for EP0
 static uint8_t ep0_buf[64];
 
-// Global data buffer for EP1
-static uint8_t ep1_buf[64];
+// A bulk IN endpoint streaming random data
+struct usb_stream {
+    uint8_t ep_addr;
+    // The harvester stream served on this endpoint
+    enum harvester_stream source;
+    // The next packet, prepared ahead of time
+    uint8_t buf[64];
+    uint16_t len;
+    // Bit n set while buffer n holds a packet the host hasn't taken yet
+    uint8_t armed;
+};
+
+// EP1 serves whichever stream the host selected, EP2 and EP3 serve one each
+static struct usb_stream ep1_stream = { .ep_addr = EP1_IN_ADDR, .source = HARVESTER_DEFAULT_MODE };
+static struct usb_stream ep2_stream = { .ep_addr = EP2_IN_ADDR, .source = HARVESTER_STREAM_RAW };
+static struct usb_stream ep3_stream = { .ep_addr = EP3_IN_ADDR, .source = HARVESTER_STREAM_CONDITIONED };
 
 // Struct defining the device configuration
 static struct usb_device_configuration dev_config = {
@@ -77,12 +117,43 @@ static struct usb_device_configuration dev_config = {
                         .handler = &ep1_in_handler,
                         .endpoint_control = &usb_dpram->ep_ctrl[0].in,
                         .buffer_control = &usb_dpram->ep_buf_ctrl[1].in,
-                        // First free EPX buffer
+                        // First two free EPX buffers
                         .data_buffer = &usb_dpram->epx_data[0],
+                        .double_buffered = true,
+                },
+                {
+                        .descriptor = &ep2_in,
+                        .handler = &ep2_in_handler,
+                        .endpoint_control = &usb_dpram->ep_ctrl[1].in,
+                        .buffer_control = &usb_dpram->ep_buf_ctrl[2].in,
+                        .data_buffer = &usb_dpram->epx_data[2 * 64],
+                        .double_buffered = true,
+                },
+                {
+                        .descriptor = &ep3_in,
+                        .handler = &ep3_in_handler,
+                        .endpoint_control = &usb_dpram->ep_ctrl[2].in,
+                        .buffer_control = &usb_dpram->ep_buf_ctrl[3].in,
+                        .data_buffer = &usb_dpram->epx_data[4 * 64],
+                        .double_buffered = true,
                 }
         }
 };
 
+// Endpoint configurations indexed by their bit in the buf_status register, built by usb_setup_endpoints()
+static struct usb_endpoint_configuration *ep_dispatch[USB_NUM_ENDPOINTS * 2];
+
+/**
+ * @brief Given an endpoint address, return its bit position in the buf_status register.
+ * IN endpoints are on even bits, OUT endpoints on odd bits.
+ *
+ * @param addr
+ * @return uint
+ */
+static inline uint usb_endpoint_bit(uint8_t addr) {
+    return ((addr & 0xfu) << 1u) | ((addr & USB_DIR_IN) ? 0u : 1u);
+}
+
 /**
  * @brief Given an endpoint address, return the usb_endpoint_configuration of that endpoint. Returns NULL
  * if an endpoint of that address is not found.
@@ -91,13 +162,7 @@ static struct usb_device_configuration dev_config = {
  * @return struct usb_endpoint_configuration*
  */
 struct usb_endpoint_configuration *usb_get_endpoint_configuration(uint8_t addr) {
-    struct usb_endpoint_configuration *endpoints = dev_config.endpoints;
-    for (int i = 0; i < USB_NUM_ENDPOINTS; i++) {
-        if (endpoints[i].descriptor && (endpoints[i].descriptor->bEndpointAddress == addr)) {
-            return &endpoints[i];
-        }
-    }
-    return NULL;
+    return ep_dispatch[usb_endpoint_bit(addr)];
 }
 
 /**
@@ -142,7 +207,7 @@ static inline uint32_t usb_buffer_offset(volatile uint8_t *buf) {
  * @param ep
  */
 void usb_setup_endpoint(const struct usb_endpoint_configuration *ep) {
-    printf("Set up endpoint 0x%x with buffer address 0x%p\n", ep->descriptor->bEndpointAddress, ep->data_buffer);
+    LOGGER_INFO("Set up endpoint 0x%x with buffer address 0x%p\n", ep->descriptor->bEndpointAddress, ep->data_buffer);
 
     // EP0 doesn't have one so return if that is the case
     if (!ep->endpoint_control) {
@@ -155,6 +220,9 @@ void usb_setup_endpoint(const struct usb_endpoint_configuration *ep) {
                    | EP_CTRL_INTERRUPT_PER_BUFFER
                    | (ep->descriptor->bmAttributes << EP_CTRL_BUFFER_TYPE_LSB)
                    | dpram_offset;
+    if (ep->double_buffered) {
+        reg |= EP_CTRL_DOUBLE_BUFFERED_BITS;
+    }
     *ep->endpoint_control = reg;
 }
 
@@ -163,10 +231,12 @@ void usb_setup_endpoint(const struct usb_endpoint_configuration *ep) {
  *
  */
 void usb_setup_endpoints() {
-    const struct usb_endpoint_configuration *endpoints = dev_config.endpoints;
+    struct usb_endpoint_configuration *endpoints = dev_config.endpoints;
     for (int i = 0; i < USB_NUM_ENDPOINTS; i++) {
         if (endpoints[i].descriptor && endpoints[i].handler) {
             usb_setup_endpoint(&endpoints[i]);
+            // So the IRQ can go straight from a buf_status bit to the endpoint
+            ep_dispatch[usb_endpoint_bit(endpoints[i].descriptor->bEndpointAddress)] = &endpoints[i];
         }
     }
 }
@@ -199,10 +269,12 @@ void usb_device_init() {
     usb_hw->sie_ctrl = USB_SIE_CTRL_EP0_INT_1BUF_BITS; // <2>
 
     // Enable interrupts for when a buffer is done, when the bus is reset,
-    // and when a setup packet is received
+    // when a setup packet is received and when the host suspends or resumes the bus
     usb_hw->inte = USB_INTS_BUFF_STATUS_BITS |
                    USB_INTS_BUS_RESET_BITS |
-                   USB_INTS_SETUP_REQ_BITS;
+                   USB_INTS_SETUP_REQ_BITS |
+                   USB_INTS_DEV_SUSPEND_BITS |
+                   USB_INTS_DEV_RESUME_FROM_HOST_BITS;
 
     // Set up endpoints (endpoint control registers)
     // described by device configuration
@@ -236,14 +308,15 @@ void usb_start_transfer(struct usb_endpoint_configuration *ep, uint8_t *buf, uin
     // For multi packet transfers see the tinyusb port.
     assert(len <= 64);
 
-    printf("Start transfer of len %d on ep addr 0x%x\n", len, ep->descriptor->bEndpointAddress);
+    LOGGER_DEBUG("Start transfer of len %d on ep addr 0x%x\n", len, ep->descriptor->bEndpointAddress);
+    trace_record(TRACE_START_TRANSFER, (ep->descriptor->bEndpointAddress << 8) | len);
 
     // Prepare buffer control register value
     uint32_t val = len | USB_BUF_CTRL_AVAIL;
 
     if (ep_is_tx(ep)) {
         // Need to copy the data from the user buffer to the usb memory
-        memcpy((void *) ep->data_buffer, (void *) buf, len);
+        memcpy((void *) (ep->data_buffer + ep->next_buf * 64), (void *) buf, len);
         // Mark as full
         val |= USB_BUF_CTRL_FULL;
     }
@@ -252,7 +325,32 @@ void usb_start_transfer(struct usb_endpoint_configuration *ep, uint8_t *buf, uin
     val |= ep->next_pid ? USB_BUF_CTRL_DATA1_PID : USB_BUF_CTRL_DATA0_PID;
     ep->next_pid ^= 1u;
 
-    *ep->buffer_control = val;
+    if (ep->double_buffered) {
+        // Each buffer owns one half of the buffer control register. Only write our half so an
+        // update the controller makes to the other one in the meantime isn't lost.
+        volatile uint16_t *buffer_control = (volatile uint16_t *) ep->buffer_control + ep->next_buf;
+        // The controller may be busy on the other buffer, so AVAILABLE has to be set last,
+        // at least 3 clk_usb cycles after the rest of the half has been written
+        *buffer_control = val & ~USB_BUF_CTRL_AVAIL;
+        __asm volatile ("nop\n nop\n nop\n nop\n nop\n nop\n nop\n nop");
+        *buffer_control = val;
+        ep->next_buf ^= 1u;
+    } else {
+        *ep->buffer_control = val;
+    }
+}
+
+/**
+ * @brief Given an endpoint configuration, returns true if the controller is done with
+ * the buffer the next transfer goes in.
+ *
+ * @param ep, the endpoint configuration
+ * @return true
+ * @return false
+ */
+static inline bool usb_buffer_free(struct usb_endpoint_configuration *ep) {
+    volatile uint16_t *buffer_control = (volatile uint16_t *) ep->buffer_control + ep->next_buf;
+    return !(*buffer_control & USB_BUF_CTRL_AVAIL);
 }
 
 /**
@@ -346,12 +444,57 @@ void usb_set_device_address(volatile struct usb_setup_packet *pkt) {
     // Set address is a bit of a strange case because we have to send a 0 length status packet first with
     // address 0
     dev_addr = (pkt->wValue & 0xff);
-    printf("Set address %d\r\n", dev_addr);
+    LOGGER_INFO("Set address %d\r\n", dev_addr);
     // Will set address in the callback phase
     should_set_address = true;
     usb_start_transfer(usb_get_endpoint_configuration(EP0_IN_ADDR), NULL, 0);
 }
 
+/**
+ * @brief Arm every buffer of a streaming endpoint the controller is done with, in the order
+ * it will send them. Each one gets the packet prepared ahead of time, and the following packet
+ * is prepared while that one is on the wire.
+ *
+ * @param stream, the streaming endpoint
+ * @return the number of packets the host took since the last fill, buffers armed from scratch don't count
+ */
+uint usb_stream_fill(struct usb_stream *stream) {
+    struct usb_endpoint_configuration *ep = usb_get_endpoint_configuration(stream->ep_addr);
+    uint sent = 0;
+
+    while (usb_buffer_free(ep)) {
+        uint8_t bit = 1u << ep->next_buf;
+        if (stream->armed & bit) {
+            sent++;
+        }
+        stream->armed |= bit;
+        usb_start_transfer(ep, stream->buf, stream->len);
+        stream->len = get_random_data(stream->source, stream->buf, 64);
+        if (stream->len < 64) {
+            trace_record(TRACE_STREAM_SHORT, (stream->ep_addr << 8) | stream->len);
+        }
+    }
+
+    return sent;
+}
+
+/**
+ * @brief Start a streaming endpoint from a known state, buffer selector back on buffer 0
+ * and DATA0 next, and populate both TX buffers.
+ *
+ * @param stream, the streaming endpoint
+ */
+void usb_stream_start(struct usb_stream *stream) {
+    struct usb_endpoint_configuration *ep = usb_get_endpoint_configuration(stream->ep_addr);
+    *ep->buffer_control = USB_BUF_CTRL_SEL;
+    ep->next_pid = 0;
+    ep->next_buf = 0;
+    stream->armed = 0;
+
+    stream->len = get_random_data(stream->source, stream->buf, 64);
+    usb_stream_fill(stream);
+}
+
 /**
  * @brief Handles a SET_CONFIGRUATION request from the host. Assumes one configuration so simply
  * sends a zero length status packet back to the host.
@@ -360,9 +503,120 @@ void usb_set_device_address(volatile struct usb_setup_packet *pkt) {
  */
 void usb_set_device_configuration(volatile struct usb_setup_packet *pkt) {
     // Only one configuration so just acknowledge the request
-    printf("Device Enumerated\r\n");
+    LOGGER_INFO("Device Enumerated\r\n");
     usb_start_transfer(usb_get_endpoint_configuration(EP0_IN_ADDR), NULL, 0);
     configured = true;
+
+    usb_stream_start(&ep1_stream);
+    usb_stream_start(&ep2_stream);
+    usb_stream_start(&ep3_stream);
+}
+
+/**
+ * @brief Send the counters block to the host.
+ *
+ * @param pkt, the setup packet from the host.
+ */
+void usb_handle_get_stats(volatile struct usb_setup_packet *pkt) {
+    struct pico_rng_stats stats = {
+            .version = PICO_RNG_STATS_VERSION,
+            .length = sizeof(struct pico_rng_stats),
+            .bytes_produced = harvester_bytes_produced(),
+            .adc_samples = adc_sampler_samples(),
+            .packets_sent = usb_stats.packets_sent,
+            .irq_count = usb_stats.irq_count,
+            .irq_min_us = usb_stats.irq_count ? usb_stats.irq_min_us : 0,
+            .irq_avg_us = usb_stats.irq_count ? (uint32_t) (usb_stats.irq_total_us / usb_stats.irq_count) : 0,
+            .irq_max_us = usb_stats.irq_max_us,
+    };
+
+    // The block is packed, so go through locals rather than pointing into it
+    for (int i = 0; i < HARVESTER_NUM_STREAMS; i++) {
+        uint16_t high, low;
+        harvester_get_watermarks(i, &high, &low);
+        stats.ring_high[i] = high;
+        stats.ring_low[i] = low;
+    }
+
+    uint32_t rct, apt;
+    stats.health_failures = harvester_health_failures(&rct, &apt);
+    stats.rct_failures = rct;
+    stats.apt_failures = apt;
+    stats.health_status = harvester_health_ok() ? PICO_RNG_HEALTH_OK : PICO_RNG_HEALTH_QUARANTINE;
+
+    uint16_t len = pkt->wLength < sizeof(stats) ? pkt->wLength : sizeof(stats);
+    memcpy(&ep0_buf[0], &stats, len);
+    usb_start_transfer(usb_get_endpoint_configuration(EP0_IN_ADDR), &ep0_buf[0], len);
+}
+
+/**
+ * @brief Start the USB core's counters over.
+ *
+ */
+void usb_reset_stats(void) {
+    usb_stats.packets_sent = 0;
+    usb_stats.irq_count = 0;
+    usb_stats.irq_min_us = UINT32_MAX;
+    usb_stats.irq_max_us = 0;
+    usb_stats.irq_total_us = 0;
+    harvester_reset_watermarks();
+}
+
+/**
+ * @brief Reject the control request in progress by stalling EP0 IN, so the host sees EPIPE on the
+ * status stage right away instead of timing out. The controller disarms the stall on the next setup packet.
+ *
+ */
+static void usb_stall_ep0(void) {
+    trace_record(TRACE_STALL, 0);
+    usb_hw_set->ep_stall_arm = USB_EP_STALL_ARM_EP0_IN_BITS;
+    *usb_get_endpoint_configuration(EP0_IN_ADDR)->buffer_control = USB_BUF_CTRL_STALL;
+}
+
+/**
+ * @brief Handle a vendor specific request from the host. Apart from GET_STATS none of them
+ * have a data stage, so acknowledge with a zero length status packet. Bad ones are stalled.
+ *
+ * @param pkt, the setup packet from the host.
+ */
+void usb_handle_vendor_request(volatile struct usb_setup_packet *pkt) {
+    trace_record(TRACE_VENDOR_REQUEST, pkt->bRequest);
+
+    switch (pkt->bRequest) {
+        case PICO_RNG_REQUEST_SET_MODE:
+            if (pkt->wValue >= HARVESTER_NUM_STREAMS) {
+                LOGGER_WARN("Unknown mode %d\r\n", pkt->wValue);
+                usb_stall_ep0();
+                return;
+            }
+            ep1_stream.source = (enum harvester_stream) pkt->wValue;
+            LOGGER_INFO("SET MODE %d\r\n", pkt->wValue);
+            break;
+
+        case PICO_RNG_REQUEST_SET_RESEED_INTERVAL:
+            harvester_set_reseed_interval((uint32_t) pkt->wValue * 1024);
+            LOGGER_INFO("SET RESEED INTERVAL %d KiB\r\n", pkt->wValue);
+            break;
+
+        case PICO_RNG_REQUEST_DUMP_TRACE:
+            trace_dump_requested = true;
+            break;
+
+        case PICO_RNG_REQUEST_GET_STATS:
+            usb_handle_get_stats(pkt);
+            return;
+
+        case PICO_RNG_REQUEST_RESET_STATS:
+            usb_reset_stats();
+            break;
+
+        default:
+            LOGGER_WARN("Unhandled vendor request (0x%x)\r\n", pkt->bRequest);
+            usb_stall_ep0();
+            return;
+    }
+
+    usb_start_transfer(usb_get_endpoint_configuration(EP0_IN_ADDR), NULL, 0);
 }
 
 /**
@@ -374,16 +628,20 @@ void usb_handle_setup_packet(void) {
     uint8_t req_direction = pkt->bmRequestType;
     uint8_t req = pkt->bRequest;
 
+    trace_record(TRACE_SETUP, req);
+
     // Reset PID to 1 for EP0 IN
     usb_get_endpoint_configuration(EP0_IN_ADDR)->next_pid = 1u;
 
-    if (req_direction == USB_DIR_OUT) {
+    if ((req_direction & USB_REQ_TYPE_TYPE_MASK) == USB_REQ_TYPE_TYPE_VENDOR) {
+        usb_handle_vendor_request(pkt);
+    } else if (req_direction == USB_DIR_OUT) {
         if (req == USB_REQUEST_SET_ADDRESS) {
             usb_set_device_address(pkt);
         } else if (req == USB_REQUEST_SET_CONFIGURATION) {
             usb_set_device_configuration(pkt);
         } else {
-            printf("Other OUT request (0x%x)\r\n", pkt->bRequest);
+            LOGGER_WARN("Other OUT request (0x%x)\r\n", pkt->bRequest);
         }
     } else if (req_direction == USB_DIR_IN) {
         if (req == USB_REQUEST_GET_DESCRIPTOR) {
@@ -392,24 +650,24 @@ void usb_handle_setup_packet(void) {
             switch (descriptor_type) {
                 case USB_DT_DEVICE:
                     usb_handle_device_descriptor();
-                    printf("GET DEVICE DESCRIPTOR\r\n");
+                    LOGGER_INFO("GET DEVICE DESCRIPTOR\r\n");
                     break;
 
                 case USB_DT_CONFIG:
                     usb_handle_config_descriptor(pkt);
-                    printf("GET CONFIG DESCRIPTOR\r\n");
+                    LOGGER_INFO("GET CONFIG DESCRIPTOR\r\n");
                     break;
 
                 case USB_DT_STRING:
                     usb_handle_string_descriptor(pkt);
-                    printf("GET STRING DESCRIPTOR\r\n");
+                    LOGGER_INFO("GET STRING DESCRIPTOR\r\n");
                     break;
 
                 default:
-                    printf("Unhandled GET_DESCRIPTOR type 0x%x\r\n", descriptor_type);
+                    LOGGER_WARN("Unhandled GET_DESCRIPTOR type 0x%x\r\n", descriptor_type);
             }
         } else {
-            printf("Other IN request (0x%x)\r\n", pkt->bRequest);
+            LOGGER_WARN("Other IN request (0x%x)\r\n", pkt->bRequest);
         }
     }
 }
@@ -428,46 +686,29 @@ static void usb_handle_ep_buff_done(struct usb_endpoint_configuration *ep) {
     ep->handler((uint8_t *) ep->data_buffer, len);
 }
 
-/**
- * @brief Find the endpoint configuration for a specified endpoint number and
- * direction and notify it that a transfer has completed.
- *
- * @param ep_num
- * @param in
- */
-static void usb_handle_buff_done(uint ep_num, bool in) {
-    uint8_t ep_addr = ep_num | (in ? USB_DIR_IN : 0);
-    printf("EP %d (in = %d) done\n", ep_num, in);
-    for (uint i = 0; i < USB_NUM_ENDPOINTS; i++) {
-        struct usb_endpoint_configuration *ep = &dev_config.endpoints[i];
-        if (ep->descriptor && ep->handler) {
-            if (ep->descriptor->bEndpointAddress == ep_addr) {
-                usb_handle_ep_buff_done(ep);
-                return;
-            }
-        }
-    }
-}
-
 /**
  * @brief Handle a "buffer status" irq. This means that one or more
  * buffers have been sent / received. Notify each endpoint where this
  * is the case.
  */
 static void usb_handle_buff_status() {
-    uint32_t buffers = usb_hw->buf_status;
-    uint32_t remaining_buffers = buffers;
-
-    uint bit = 1u;
-    for (uint i = 0; remaining_buffers && i < USB_NUM_ENDPOINTS * 2; i++) {
-        if (remaining_buffers & bit) {
-            // clear this in advance
-            usb_hw_clear->buf_status = bit;
-            // IN transfer for even i, OUT transfer for odd i
-            usb_handle_buff_done(i >> 1u, !(i & 1u));
-            remaining_buffers &= ~bit;
+    uint32_t remaining_buffers = usb_hw->buf_status;
+
+    while (remaining_buffers) {
+        // IN transfer for even i, OUT transfer for odd i
+        uint i = __builtin_ctz(remaining_buffers);
+        uint32_t bit = 1u << i;
+
+        // clear this in advance
+        usb_hw_clear->buf_status = bit;
+        remaining_buffers &= ~bit;
+
+        struct usb_endpoint_configuration *ep = ep_dispatch[i];
+        LOGGER_DEBUG("EP %d (in = %d) done\n", i >> 1u, !(i & 1u));
+        trace_record(TRACE_BUFF_DONE, i);
+        if (ep) {
+            usb_handle_ep_buff_done(ep);
         }
-        bit <<= 1u;
     }
 }
 
@@ -478,6 +719,7 @@ static void usb_handle_buff_status() {
 /// \tag::isr_setup_packet[]
 void isr_usbctrl(void) {
     // USB interrupt handler
+    uint32_t start = time_us_32();
     uint32_t status = usb_hw->ints;
     uint32_t handled = 0;
 
@@ -497,15 +739,51 @@ void isr_usbctrl(void) {
 
     // Bus is reset
     if (status & USB_INTS_BUS_RESET_BITS) {
-        printf("BUS RESET\n");
+        LOGGER_INFO("BUS RESET\n");
+        trace_record(TRACE_BUS_RESET, 0);
         handled |= USB_INTS_BUS_RESET_BITS;
         usb_hw_clear->sie_status = USB_SIE_STATUS_BUS_RESET_BITS;
         usb_bus_reset();
+        suspended = false;
+        harvester_set_suspended(false);
+    }
+
+    // Bus suspended by the host. The armed EP buffers stay armed, so the
+    // packets waiting in them go out as soon as the host resumes.
+    if (status & USB_INTS_DEV_SUSPEND_BITS) {
+        LOGGER_DEBUG("SUSPEND\n");
+        trace_record(TRACE_SUSPEND, 0);
+        handled |= USB_INTS_DEV_SUSPEND_BITS;
+        usb_hw_clear->sie_status = USB_SIE_STATUS_SUSPENDED_BITS;
+        suspended = true;
+        harvester_set_suspended(true);
+        gpio_put(25, 0);
+    }
+
+    // Bus resumed by the host
+    if (status & USB_INTS_DEV_RESUME_FROM_HOST_BITS) {
+        LOGGER_DEBUG("RESUME\n");
+        trace_record(TRACE_RESUME, 0);
+        handled |= USB_INTS_DEV_RESUME_FROM_HOST_BITS;
+        usb_hw_clear->sie_status = USB_SIE_STATUS_RESUME_BITS;
+        suspended = false;
+        harvester_set_suspended(false);
     }
 
     if (status ^ handled) {
         panic("Unhandled IRQ 0x%x\n", (uint) (status ^ handled));
     }
+
+    // Service time, from the hardware timer
+    uint32_t elapsed = time_us_32() - start;
+    usb_stats.irq_count++;
+    usb_stats.irq_total_us += elapsed;
+    if (elapsed < usb_stats.irq_min_us) {
+        usb_stats.irq_min_us = elapsed;
+    }
+    if (elapsed > usb_stats.irq_max_us) {
+        usb_stats.irq_max_us = elapsed;
+    }
 }
 
 /**
@@ -541,47 +819,66 @@ void ep0_out_handler(uint8_t *buf, uint16_t len) {
 /**
  * @brief Get random data using the onboard pico ADC that essentially measure 
  *        environmental noise because it is assumed that it is not connected to anything.
+ *        The sampling is done on core1, this only drains what it has already harvested,
+ *        so it never waits on a conversion.
  *
+ * @param stream the harvester stream to take the data from
  * @param buf the buffer to store the random data in
  * @param len the length of the random data in bytes
+ * @return the number of bytes stored in buf, less than len if core1 has fallen behind
  */
-void get_random_data(char *buf, uint16_t len) {
-    uint16_t adc_result;
-    uint8_t size;
-    int i;
+uint16_t get_random_data(enum harvester_stream stream, uint8_t *buf, uint16_t len) {
+    uint16_t count;
 
     gpio_put(25, 1);
 
     if(len > 64)
     {
-        //TODO handle length error
-        size = 64;
+        len = 64;
     }
 
-    memset(buf, 0, len);
-    for(i = 1; i <= len; i=i+1)
-    {
-        adc_result = adc_read();
-        memcpy(&buf[i-1], (void*)&adc_result, 2);
-    }
+    count = harvester_read(stream, buf, len);
 
     gpio_put(25, 0);
+
+    return count;
 }
 
 /**
- * @brief EP1 in transfer complete. Prime the EP1 in buffer
- * with more random data.
+ * @brief EP1 in transfer complete. Prime the free EP1 in buffer(s)
+ * with more data from the selected stream.
  *
  * @param buf the data that was sent
  * @param len the length that was sent
  */
 void ep1_in_handler(uint8_t *buf, uint16_t len) {
 
-    printf("Sent %d bytes to host\n", len);
-    
-    // Prime the EP1 IN buffer for the next transfer
-    get_random_data(ep1_buf, 64);
-    usb_start_transfer(usb_get_endpoint_configuration(EP1_IN_ADDR), ep1_buf, 64);
+    LOGGER_DEBUG("Sent %d bytes to host\n", len);
+
+    // Both buffers may have gone out before we got here, count every packet that did
+    usb_stats.packets_sent += usb_stream_fill(&ep1_stream);
+}
+
+/**
+ * @brief EP2 in transfer complete. Prime the free EP2 in buffer(s)
+ * with more raw data.
+ *
+ * @param buf the data that was sent
+ * @param len the length that was sent
+ */
+void ep2_in_handler(uint8_t *buf, uint16_t len) {
+    usb_stats.packets_sent += usb_stream_fill(&ep2_stream);
+}
+
+/**
+ * @brief EP3 in transfer complete. Prime the free EP3 in buffer(s)
+ * with more conditioned data.
+ *
+ * @param buf the data that was sent
+ * @param len the length that was sent
+ */
+void ep3_in_handler(uint8_t *buf, uint16_t len) {
+    usb_stats.packets_sent += usb_stream_fill(&ep3_stream);
 }
 
 /**
@@ -595,25 +892,24 @@ int main(void) {
     gpio_init(25);
     gpio_set_dir(25, GPIO_OUT);
 
-    // ADC
-    adc_init();
-    adc_gpio_init(26);
-    adc_select_input(0);
+    // Core1 owns the ADC and does all the harvesting
+    multicore_launch_core1(harvester_core1_main);
 
-    printf("USB pico rng\n");
+    LOGGER_INFO("USB pico rng\n");
     usb_device_init();
 
-    // Wait until configured
-    while (!configured) {
-        tight_loop_contents();
-    }
-
-    // Populate the TX buffer
-    get_random_data(ep1_buf, 64);
-    usb_start_transfer(usb_get_endpoint_configuration(EP1_IN_ADDR), ep1_buf, 64);
-
-    // Everything is interrupt driven so just loop here
+    // Everything on this core is interrupt driven so just loop here,
+    // printing the trace from thread context when the host asks for it.
+    // While the bus is suspended sleep until the resume interrupt instead of spinning,
+    // core1 parks itself and the ADC at the same time.
     while (1) {
+        if (trace_dump_requested) {
+            trace_dump_requested = false;
+            trace_dump();
+        }
+        if (suspended) {
+            __wfi();
+        }
         tight_loop_contents();
     }
 
@@ -23,6 +23,11 @@ struct usb_endpoint_configuration {
 
     // Toggle after each packet (unless replying to a SETUP)
     uint8_t next_pid;
+
+    // Alternate between two 64 byte buffers at data_buffer and data_buffer + 64
+    bool double_buffered;
+    // Buffer the next transfer goes in. Always 0 unless double buffered
+    uint8_t next_buf;
 };
 
 // Struct in which we keep the device configuration
@@ -39,6 +44,40 @@ struct usb_device_configuration {
 #define EP0_IN_ADDR  (USB_DIR_IN  | 0)
 #define EP0_OUT_ADDR (USB_DIR_OUT | 0)
 #define EP1_IN_ADDR  (USB_DIR_IN  | 1)
+#define EP2_IN_ADDR  (USB_DIR_IN  | 2)
+#define EP3_IN_ADDR  (USB_DIR_IN  | 3)
+
+// Vendor requests on EP0 (bmRequestType USB_REQ_TYPE_TYPE_VENDOR | USB_REQ_TYPE_RECIPIENT_DEVICE)
+#define PICO_RNG_REQUEST_SET_MODE            0x01 // wValue = enum harvester_stream served on EP1
+#define PICO_RNG_REQUEST_SET_RESEED_INTERVAL 0x02 // wValue = conditioned KiB between reseeds
+#define PICO_RNG_REQUEST_DUMP_TRACE          0x03 // print the trace rings on the UART
+#define PICO_RNG_REQUEST_GET_STATS           0x04 // IN, returns struct pico_rng_stats
+#define PICO_RNG_REQUEST_RESET_STATS         0x05 // start packets, watermarks and IRQ times over
+
+#define PICO_RNG_STATS_VERSION 2
+
+// Counters block returned by PICO_RNG_REQUEST_GET_STATS, little endian
+struct pico_rng_stats {
+    uint16_t version;         // PICO_RNG_STATS_VERSION
+    uint16_t length;          // sizeof(struct pico_rng_stats)
+    uint64_t bytes_produced;  // bytes core1 put in the stream rings since power up
+    uint64_t adc_samples;     // ADC conversions since power up
+    uint32_t packets_sent;    // bulk IN packets taken by the host on EP1-3
+    uint16_t ring_high[2];    // highest fill of each stream ring seen by the USB core, indexed by enum harvester_stream
+    uint16_t ring_low[2];     // lowest fill of each stream ring seen by the USB core
+    uint32_t irq_count;       // USB IRQs serviced
+    uint32_t irq_min_us;      // USB IRQ service time, from the hardware timer
+    uint32_t irq_avg_us;
+    uint32_t irq_max_us;
+    uint32_t health_failures; // health test failures since power up, rct_failures + apt_failures
+    uint32_t rct_failures;    // SP 800-90B Repetition Count Test failures
+    uint32_t apt_failures;    // SP 800-90B Adaptive Proportion Test failures
+    uint32_t health_status;   // PICO_RNG_HEALTH_*
+} __packed;
+
+// health_status values
+#define PICO_RNG_HEALTH_OK         0 // samples are passing, output is flowing
+#define PICO_RNG_HEALTH_QUARANTINE 1 // output held back until enough samples pass again
 
 // EP0 IN and OUT
 static const struct usb_endpoint_descriptor ep0_out = {
@@ -82,7 +121,7 @@ static const struct usb_interface_descriptor interface_descriptor = {
         .bDescriptorType    = USB_DT_INTERFACE,
         .bInterfaceNumber   = 0,
         .bAlternateSetting  = 0,
-        .bNumEndpoints      = 1,    // Interface has 1 endpoint
+        .bNumEndpoints      = 3,    // Interface has 3 endpoints
         .bInterfaceClass    = 0xef, // Miscellaneous device. See https://www.usb.org/defined-class-codes.
         .bInterfaceSubClass = 0,
         .bInterfaceProtocol = 0,
@@ -92,7 +131,25 @@ static const struct usb_interface_descriptor interface_descriptor = {
 static const struct usb_endpoint_descriptor ep1_in = {
         .bLength          = sizeof(struct usb_endpoint_descriptor),
         .bDescriptorType  = USB_DT_ENDPOINT,
-        .bEndpointAddress = EP1_IN_ADDR, // EP number 1, IN from host (tx from device)
+        .bEndpointAddress = EP1_IN_ADDR, // EP number 1, IN from host (tx from device). Selected stream
+        .bmAttributes     = USB_TRANSFER_TYPE_BULK,
+        .wMaxPacketSize   = 64,
+        .bInterval        = 0
+};
+
+static const struct usb_endpoint_descriptor ep2_in = {
+        .bLength          = sizeof(struct usb_endpoint_descriptor),
+        .bDescriptorType  = USB_DT_ENDPOINT,
+        .bEndpointAddress = EP2_IN_ADDR, // EP number 2, IN from host (tx from device). Raw stream
+        .bmAttributes     = USB_TRANSFER_TYPE_BULK,
+        .wMaxPacketSize   = 64,
+        .bInterval        = 0
+};
+
+static const struct usb_endpoint_descriptor ep3_in = {
+        .bLength          = sizeof(struct usb_endpoint_descriptor),
+        .bDescriptorType  = USB_DT_ENDPOINT,
+        .bEndpointAddress = EP3_IN_ADDR, // EP number 3, IN from host (tx from device). Conditioned stream
         .bmAttributes     = USB_TRANSFER_TYPE_BULK,
         .wMaxPacketSize   = 64,
         .bInterval        = 0
@@ -103,7 +160,9 @@ static const struct usb_configuration_descriptor config_descriptor = {
         .bDescriptorType = USB_DT_CONFIG,
         .wTotalLength    = (sizeof(config_descriptor) +
                             sizeof(interface_descriptor) +
-                            sizeof(ep1_in)),
+                            sizeof(ep1_in) +
+                            sizeof(ep2_in) +
+                            sizeof(ep3_in)),
         .bNumInterfaces  = 1,
         .bConfigurationValue = 1, // Configuration 1
         .iConfiguration = 0,      // No string
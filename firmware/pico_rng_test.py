@@ -4,19 +4,124 @@ import usb.core
 import usb.util
 import os
 import random
+import struct
 import time
 import argparse
+import mmap
+import select
+import threading
+import fcntl
+import multiprocessing
 
 # Parser stuff
 parser = argparse.ArgumentParser(description="Raspberry Pi Pico Random Number Generator Test Tool")
 parser.add_argument("--performance", action="store_true", help="Performance test the RNG.")
+parser.add_argument("--size", type=int, default=64, help="Bytes per read. Multiples of 64 keep back to back packets in one transfer.")
+parser.add_argument("--mode", choices=["raw", "conditioned"], help="Switch the device output stream before testing.")
+parser.add_argument("--stats", action="store_true", help="Print the device counters.")
+parser.add_argument("--reset-stats", action="store_true", help="Start the device counters over.")
+parser.add_argument("--dump-trace", action="store_true", help="Ask the device to print its trace rings on the UART.")
+parser.add_argument("--path", type=int, choices=[0, 1, 2], default=0, help="Endpoint to read with libusb. 0 = selected stream (EP1), 1 = raw (EP2), 2 = conditioned (EP3).")
+parser.add_argument("--mmap", metavar="DEVICE", help="Consume the ring shared through mmap of DEVICE (e.g. /dev/pico_rng0) instead of reading.")
+parser.add_argument("--drbg", action="store_true", help="Read /dev/pico_rng through the kernel DRBG seeded from the Pico.")
+parser.add_argument("--threads", type=int, default=1, help="Readers of /dev/pico_rng running at once with --performance.")
+parser.add_argument("--scaling", type=int, metavar="MAX", help="Print a table of the total read rate of /dev/pico_rng with 1, 2, 4, ... MAX reader processes.")
+parser.add_argument("--duration", type=int, default=5, help="Seconds each row of --scaling is measured for.")
 args = parser.parse_args()
 
+# Vendor requests, see firmware/pico_rng.h
+PICO_RNG_REQUEST_SET_MODE = 0x01
+PICO_RNG_REQUEST_DUMP_TRACE = 0x03
+PICO_RNG_REQUEST_GET_STATS = 0x04
+PICO_RNG_REQUEST_RESET_STATS = 0x05
+PICO_RNG_MODES = { "raw": 0, "conditioned": 1 }
+
+# struct pico_rng_stats
+PICO_RNG_STATS_FORMAT = "<HHQQIHHHHIIIIIIII"
+PICO_RNG_STATS_FIELDS = ["version", "length", "bytes_produced", "adc_samples", "packets_sent",
+                         "raw_ring_high", "conditioned_ring_high", "raw_ring_low", "conditioned_ring_low",
+                         "irq_count", "irq_min_us", "irq_avg_us", "irq_max_us", "health_failures",
+                         "rct_failures", "apt_failures", "health_status"]
+
+# struct pico_rng_ring_header, see driver/pico_rng_uapi.h
+PICO_RNG_RING_VERSION = 1
+PICO_RNG_RING_FORMAT = "<IIQQQ"
+PICO_RNG_RING_TAIL_OFFSET = 24
+
+def vendor_request(request, value=0, length=None):
+    # Control transfers work whether or not the kernel module owns the interface
+    dev = usb.core.find(idVendor=0x0000, idProduct=0x0004)
+    assert dev is not None
+    if length is None:
+        return dev.ctrl_transfer(usb.util.CTRL_OUT | usb.util.CTRL_TYPE_VENDOR | usb.util.CTRL_RECIPIENT_DEVICE,
+                                 request, value, 0)
+    return dev.ctrl_transfer(usb.util.CTRL_IN | usb.util.CTRL_TYPE_VENDOR | usb.util.CTRL_RECIPIENT_DEVICE,
+                             request, value, 0, length)
+
+if args.stats:
+    block = vendor_request(PICO_RNG_REQUEST_GET_STATS, length=struct.calcsize(PICO_RNG_STATS_FORMAT))
+    for name, value in zip(PICO_RNG_STATS_FIELDS, struct.unpack(PICO_RNG_STATS_FORMAT, bytes(block))):
+        print("{0:24}{1}".format(name, value))
+    exit(0)
+
+if args.reset_stats:
+    vendor_request(PICO_RNG_REQUEST_RESET_STATS)
+    exit(0)
+
+if args.mode:
+    vendor_request(PICO_RNG_REQUEST_SET_MODE, PICO_RNG_MODES[args.mode])
+
+if args.dump_trace:
+    vendor_request(PICO_RNG_REQUEST_DUMP_TRACE)
+    exit(0)
+
+if args.mmap:
+    # Consume the shared ring without a syscall per read, only polling once it runs dry
+    size = int(open("/sys/module/pico_rng/parameters/mmap_size").read())
+    fd = os.open(args.mmap, os.O_RDWR)
+    ring = mmap.mmap(fd, mmap.PAGESIZE + size, mmap.MAP_SHARED, mmap.PROT_READ | mmap.PROT_WRITE)
+    version, data_offset, size, head, tail = struct.unpack_from(PICO_RNG_RING_FORMAT, ring)
+    assert version == PICO_RNG_RING_VERSION
+    poller = select.poll()
+    poller.register(fd, select.POLLIN)
+    count = 0
+    start_time = time.time()
+    try:
+        while True:
+            head = struct.unpack_from(PICO_RNG_RING_FORMAT, ring)[3]
+            if head == tail:
+                poller.poll(1000)
+                continue
+            offset = tail & (size - 1)
+            chunk = min(head - tail, size - offset)
+            from_device = ring[data_offset + offset:data_offset + offset + chunk]
+            tail += chunk
+            struct.pack_into("<Q", ring, PICO_RNG_RING_TAIL_OFFSET, tail)
+            count += len(from_device)
+            if args.performance:
+                print("\t{0:.2f} KB/s".format(count / max(time.time() - start_time, 1) / 1024))
+            else:
+                print(from_device[:64])
+                break
+    except KeyboardInterrupt:
+        pass
+    exit(0)
+
+# _IOW('P', 1, __u32) from driver/pico_rng_uapi.h
+PICO_RNG_IOC_SET_READ_MODE = 0x40045001
+PICO_RNG_READ_DRBG = 1
+
+def open_chardev():
+    chardev = open("/dev/pico_rng", "rb", buffering=0)
+    if args.drbg:
+        fcntl.ioctl(chardev, PICO_RNG_IOC_SET_READ_MODE, struct.pack("<I", PICO_RNG_READ_DRBG))
+    return chardev
+
 # If this is set, then the /dev/pico_rng file exists
 rng_chardev = None
 
 if os.path.exists("/dev/pico_rng"):
-    rng_chardev = open("/dev/pico_rng", "rb")
+    rng_chardev = open_chardev()
     
 # File does not exist, test with usb.core
 if not rng_chardev:
@@ -30,20 +135,72 @@ if not rng_chardev:
     # Get the only interface of our device
     intf = cfg.interfaces()[0]
 
-    # Get the endpoint
-    endpt = intf.endpoints()[0]
+    # Get the endpoint, one per data path
+    endpt = intf.endpoints()[args.path]
 
 # Time tracking for bits/s
 count = 0
 start_time = (int(time.time()) - 1)
 
+def scaling_reader(index, totals, reads, stop):
+    # A process of its own so the GIL doesn't serialise the readers, and a counter of its own so they don't share a lock
+    with open_chardev() as chardev:
+        fd = chardev.fileno()
+        while not stop.is_set():
+            totals[index] += len(os.read(fd, args.size))
+            reads[index] += 1
+
+if args.scaling and rng_chardev:
+    try:
+        with open("/sys/module/pico_rng/parameters/percpu_cache") as param:
+            percpu = param.read().strip()
+    except OSError:
+        percpu = "?"
+    print("{0} byte reads, percpu_cache={1}, {2}s per row".format(args.size, percpu, args.duration))
+    print("readers\tKB/s\treads/s\tKB/s per reader")
+    readers = 1
+    while readers <= args.scaling:
+        totals = multiprocessing.Array("Q", readers, lock=False)
+        reads = multiprocessing.Array("Q", readers, lock=False)
+        stop = multiprocessing.Event()
+        procs = [multiprocessing.Process(target=scaling_reader, args=(index, totals, reads, stop)) for index in range(readers)]
+        for proc in procs:
+            proc.start()
+        # Let every reader get going before counting
+        time.sleep(1)
+        first_total, first_reads = sum(totals), sum(reads)
+        time.sleep(args.duration)
+        rate = (sum(totals) - first_total) / args.duration / 1024
+        print("{0}\t{1:.2f}\t{2:.0f}\t{3:.2f}".format(readers, rate, (sum(reads) - first_reads) / args.duration, rate / readers))
+        stop.set()
+        for proc in procs:
+            proc.join()
+        readers *= 2
+    exit(0)
+
+if args.performance and rng_chardev and args.threads > 1:
+    # Every reader gets a file of its own, the total rate is printed once a second
+    counts = [0] * args.threads
+    def reader(index):
+        with open_chardev() as chardev:
+            while True:
+                counts[index] += len(chardev.read(args.size))
+    for index in range(args.threads):
+        threading.Thread(target=reader, args=(index,), daemon=True).start()
+    try:
+        while True:
+            time.sleep(1)
+            print("{0} readers\t{1:.2f} KB/s".format(args.threads, sum(counts) / (time.time() - start_time) / 1024))
+    except KeyboardInterrupt:
+        exit(0)
+
 if args.performance:
     while True:
         try:
-            from_device = rng_chardev.read(64) if rng_chardev else endpt.read(64, 500)
-            count = count+1
+            from_device = rng_chardev.read(args.size) if rng_chardev else endpt.read(args.size, 500)
+            count = count + len(from_device)
             print(from_device, end="")
-            print("\t{0:.2f} KB/s".format((int((count * 64) / (int(time.time()) - start_time))) / 1024 ))
+            print("\t{0:.2f} KB/s".format((int(count / (int(time.time()) - start_time))) / 1024 ))
         except KeyboardInterrupt:
             exit(0)
 else:
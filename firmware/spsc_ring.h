@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include "pico/types.h"
+// For __dmb
+#include "hardware/sync.h"
+
+// Lock-free single producer / single consumer byte ring. The producer and the consumer
+// may run on different cores. Only the producer writes head and only the consumer writes tail,
+// both are free running and wrap at 2^32, so the size must be a power of two.
+struct spsc_ring {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t mask;
+    uint8_t *data;
+};
+
+#define SPSC_RING_INIT(buf) { .head = 0, .tail = 0, .mask = sizeof(buf) - 1, .data = (buf) }
+
+/**
+ * @brief Number of bytes waiting in the ring.
+ *
+ * @param ring
+ * @return uint32_t
+ */
+static inline uint32_t spsc_ring_count(const struct spsc_ring *ring) {
+    return ring->head - ring->tail;
+}
+
+/**
+ * @brief Number of bytes that can be pushed without overwriting unread data.
+ *
+ * @param ring
+ * @return uint32_t
+ */
+static inline uint32_t spsc_ring_space(const struct spsc_ring *ring) {
+    return ring->mask + 1 - spsc_ring_count(ring);
+}
+
+/**
+ * @brief Producer side. Copy up to len bytes into the ring.
+ *
+ * @param ring
+ * @param src the bytes to push
+ * @param len the number of bytes in src
+ * @return the number of bytes pushed, less than len if the ring filled up
+ */
+static inline uint32_t spsc_ring_push(struct spsc_ring *ring, const uint8_t *src, uint32_t len) {
+    uint32_t head = ring->head;
+    uint32_t space = spsc_ring_space(ring);
+
+    if (len > space) {
+        len = space;
+    }
+
+    for (uint32_t i = 0; i < len; i++) {
+        ring->data[(head + i) & ring->mask] = src[i];
+    }
+
+    // The data must be visible to the other core before the new head is
+    __dmb();
+    ring->head = head + len;
+
+    return len;
+}
+
+/**
+ * @brief Consumer side. Copy up to len bytes out of the ring.
+ *
+ * @param ring
+ * @param dst the buffer to pop into
+ * @param len the size of dst
+ * @return the number of bytes popped, less than len if the ring ran dry
+ */
+static inline uint32_t spsc_ring_pop(struct spsc_ring *ring, uint8_t *dst, uint32_t len) {
+    uint32_t tail = ring->tail;
+    uint32_t count = ring->head - tail;
+
+    if (len > count) {
+        len = count;
+    }
+
+    // Don't read the data before the head that published it
+    __dmb();
+    for (uint32_t i = 0; i < len; i++) {
+        dst[i] = ring->data[(tail + i) & ring->mask];
+    }
+
+    // Finish reading before handing the space back to the producer
+    __dmb();
+    ring->tail = tail + len;
+
+    return len;
+}
+
+#endif
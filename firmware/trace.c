@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+
+struct trace_ring trace_rings[2];
+
+static const char *trace_names[] = {
+        [TRACE_SETUP] = "setup",
+        [TRACE_VENDOR_REQUEST] = "vendor_request",
+        [TRACE_BUS_RESET] = "bus_reset",
+        [TRACE_BUFF_DONE] = "buff_done",
+        [TRACE_START_TRANSFER] = "start_transfer",
+        [TRACE_STREAM_SHORT] = "stream_short",
+        [TRACE_SUSPEND] = "suspend",
+        [TRACE_RESUME] = "resume",
+        [TRACE_STALL] = "stall",
+};
+
+// Next event to dump from each ring
+static uint32_t dumped[2];
+
+void trace_dump(void) {
+#if PICO_RNG_TRACE
+    for (uint core = 0; core < 2; core++) {
+        struct trace_ring *ring = &trace_rings[core];
+        uint32_t head = ring->head;
+        uint32_t dropped = 0;
+
+        // Events that have already been overwritten
+        if (head - dumped[core] > TRACE_RING_SIZE) {
+            dropped = head - dumped[core] - TRACE_RING_SIZE;
+            dumped[core] = head - TRACE_RING_SIZE;
+        }
+
+        for (; dumped[core] != head; dumped[core]++) {
+            struct trace_event event = ring->events[dumped[core] & (TRACE_RING_SIZE - 1)];
+
+            // The recorder may have lapped us while we were printing
+            if (ring->head - dumped[core] > TRACE_RING_SIZE) {
+                dropped++;
+                continue;
+            }
+
+            const char *name = event.id < count_of(trace_names) && trace_names[event.id] ? trace_names[event.id] : "?";
+            printf("[trace] core%u %10lu %s 0x%04x\n", core, (unsigned long) event.timestamp, name, event.arg);
+        }
+
+        if (dropped) {
+            printf("[trace] core%u %lu events dropped\n", core, (unsigned long) dropped);
+        }
+    }
+#endif
+}
@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2020 Mickey Malone.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "pico/types.h"
+// For time_us_32
+#include "pico/stdlib.h"
+
+// Set to 0 to compile every trace_record() away
+#ifndef PICO_RNG_TRACE
+#define PICO_RNG_TRACE 1
+#endif
+
+// log2 of the number of events kept per core
+#ifndef TRACE_RING_BITS
+#define TRACE_RING_BITS 8
+#endif
+
+#define TRACE_RING_SIZE (1u << TRACE_RING_BITS)
+
+// Trace event ids
+enum trace_id {
+    TRACE_SETUP = 1,          // arg = bRequest
+    TRACE_VENDOR_REQUEST,     // arg = bRequest
+    TRACE_BUS_RESET,          // arg = 0
+    TRACE_BUFF_DONE,          // arg = buf_status bit
+    TRACE_START_TRANSFER,     // arg = ep addr << 8 | len
+    TRACE_STREAM_SHORT,       // arg = ep addr << 8 | len, the harvester couldn't fill a whole packet
+    TRACE_SUSPEND,            // arg = 0
+    TRACE_RESUME,             // arg = 0
+    TRACE_STALL,              // arg = 0, a control request was rejected
+};
+
+// A timestamped event. 8 bytes so recording one is two stores.
+struct trace_event {
+    uint32_t timestamp;
+    uint16_t id;
+    uint16_t arg;
+};
+
+// One ring per core, so recording never needs a lock
+struct trace_ring {
+    volatile uint32_t head;
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+extern struct trace_ring trace_rings[2];
+
+/**
+ * @brief Record an event in the calling core's trace ring. Cheap enough for the USB IRQ,
+ * the oldest event is overwritten once the ring is full.
+ *
+ * @param id the event id
+ * @param arg event specific argument
+ */
+static inline void trace_record(enum trace_id id, uint16_t arg) {
+#if PICO_RNG_TRACE
+    struct trace_ring *ring = &trace_rings[get_core_num()];
+    uint32_t head = ring->head;
+    struct trace_event *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+
+    event->timestamp = time_us_32();
+    event->id = id;
+    event->arg = arg;
+    ring->head = head + 1;
+#endif
+}
+
+/**
+ * @brief Print every event recorded since the last dump to stdio. Call from thread context,
+ * never from an IRQ.
+ *
+ */
+void trace_dump(void);
+
+#endif